@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iimc.h"
+
+/*
+ * iimc-bench measures prefill and decode speed for every combination of the
+ * given thread counts, batch sizes and sequence lengths and prints the
+ * results as JSON.
+ *
+ * A run prefills b rows of t random tokens, then decodes up to n more
+ * tokens per row one step at a time. The prefill is run once untimed to
+ * fault in the buffers before the timed one.
+ */
+
+#define BENCH_MAX_LIST 16
+
+struct bench_cfg {
+	const char *mf;
+	int max_seq_len, vocab_size, num_layers, num_heads, channels;
+	int dtype;
+	int numa;
+	int steps;
+	int profile;
+	unsigned long long seed;
+	int batch[BENCH_MAX_LIST], n_batch;
+	int seq_len[BENCH_MAX_LIST], n_seq_len;
+	int threads[BENCH_MAX_LIST], n_threads;
+};
+
+static void print_help()
+{
+	 printf("Usage: iimc-bench [OPTION]...\n"
+		"Benchmark prefill and decode and print the results as JSON.\n\n"
+		"  -b\t\tcomma separated batch sizes (default 1)\n"
+		"  -C\t\tchannels of the random model (default 768)\n"
+		"  -h\t\tdisplay this help and exit\n"
+		"  -H\t\tattention heads of the random model (default 12)\n"
+		"  -j\t\tcomma separated thread counts (default all)\n"
+		"  -l\t\tcomma separated prompt lengths (default 128)\n"
+		"  -L\t\tlayers of the random model (default 12)\n"
+		"  -m\t\tbenchmark a model file instead of a random model\n"
+		"  -n\t\tdecode steps per run (default 32)\n"
+		"  -N\t\tplace the weights on the NUMA nodes, interleave"
+		" or replicate\n"
+		"  -P\t\tadd the time, flops and bytes of every op of the"
+		" timed\n\t\tprefill and decode steps\n"
+		"  -q\t\tconvert the weights to q8 or bf16\n"
+		"  -s\t\tseed of the random weights and tokens\n"
+		"  -T\t\tmaximum sequence length of the random model"
+		" (default 1024)\n"
+		"  -V\t\tvocabulary size of the random model (default 50257)\n");
+}
+
+static int parse_list(const char *s, int *out)
+{
+	int n = 0;
+	char *end;
+
+	while (n < BENCH_MAX_LIST) {
+		long v = strtol(s, &end, 10);
+		if (end == s || v < 1)
+			return -1;
+		out[n++] = v;
+		if (*end == '\0')
+			return n;
+		if (*end != ',')
+			return -1;
+		s = end + 1;
+	}
+	return -1;
+}
+
+static void bench_default(struct bench_cfg *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->mf = NULL;
+	p->max_seq_len = 1024;
+	p->vocab_size = 50257;
+	p->num_layers = 12;
+	p->num_heads = 12;
+	p->channels = 768;
+	p->dtype = IIMC_DTYPE_F32;
+	p->steps = 32;
+	p->seed = 1337;
+	p->batch[0] = 1;
+	p->n_batch = 1;
+	p->seq_len[0] = 128;
+	p->n_seq_len = 1;
+	p->threads[0] = sysconf(_SC_NPROCESSORS_ONLN);
+	if (p->threads[0] < 1)
+		p->threads[0] = 1;
+	p->n_threads = 1;
+}
+
+static void parse_list_opt(const char *s, int *out, int *n)
+{
+	*n = parse_list(s, out);
+	if (*n < 0) {
+		fprintf(stderr, "Bad list %s.\n", s);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void parse_cmd(int argc, char *argv[], struct bench_cfg *p)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "b:C:hH:j:l:L:m:n:N:Pq:s:T:V:")) != -1) {
+		switch (opt) {
+			case 'b':
+				parse_list_opt(optarg, p->batch,
+						&p->n_batch);
+				break;
+			case 'C':
+				p->channels = atoi(optarg);
+				break;
+			case 'h':
+				print_help();
+				exit(EXIT_SUCCESS);
+			case 'H':
+				p->num_heads = atoi(optarg);
+				break;
+			case 'j':
+				parse_list_opt(optarg, p->threads,
+						&p->n_threads);
+				break;
+			case 'l':
+				parse_list_opt(optarg, p->seq_len,
+						&p->n_seq_len);
+				break;
+			case 'L':
+				p->num_layers = atoi(optarg);
+				break;
+			case 'm':
+				p->mf = optarg;
+				break;
+			case 'n':
+				p->steps = atoi(optarg);
+				break;
+			case 'N':
+				p->numa = iimc_numa_parse(optarg);
+				if (p->numa < 0) {
+					fprintf(stderr, "Unknown NUMA placement"
+							" %s.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'P':
+				p->profile = 1;
+				break;
+			case 'q':
+				if (strcmp(optarg, "q8") == 0) {
+					p->dtype = IIMC_DTYPE_Q8;
+				} else if (strcmp(optarg, "bf16") == 0) {
+					p->dtype = IIMC_DTYPE_BF16;
+				} else {
+					fprintf(stderr, "Unknown type %s.\n",
+							optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 's':
+				p->seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'T':
+				p->max_seq_len = atoi(optarg);
+				break;
+			case 'V':
+				p->vocab_size = atoi(optarg);
+				break;
+			default:
+				print_help();
+				exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/* nearest rank percentile of n sorted values */
+static double percentile(const double *x, int n, double p)
+{
+	int i = (int) (p * n + 0.999999) - 1;
+	if (i < 0)
+		i = 0;
+	if (i > n - 1)
+		i = n - 1;
+	return x[i];
+}
+
+static void random_tokens(int *in, int n, int vocab_size,
+		unsigned long long *state)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		*state = *state * 6364136223846793005ull +
+			1442695040888963407ull;
+		in[i] = (*state >> 33) % vocab_size;
+	}
+}
+
+static const char *dtype_name(int dtype)
+{
+	switch (dtype) {
+		case IIMC_DTYPE_Q8:
+			return "q8";
+		case IIMC_DTYPE_BF16:
+			return "bf16";
+		default:
+			return "f32";
+	}
+}
+
+/* adds the per-op counters to the open result object */
+static void print_ops(struct iimc_gpt2 *m)
+{
+	int first = 1;
+	int i;
+
+	printf(", \"ops\": {");
+	for (i = 0; i < IIMC_NUM_OPS; i++) {
+		struct iimc_prof *p = &m->prof[i];
+		if (p->calls == 0)
+			continue;
+		printf("%s\n      \"%s\": {\"calls\": %llu, \"ms\": %.3f, "
+				"\"flops\": %.0f, \"bytes\": %.0f}",
+				first ? "" : ",", iimc_op_name(i), p->calls,
+				p->ns * 1e-6, p->flops, p->bytes);
+		first = 0;
+	}
+	printf("}");
+}
+
+/* one result object, or nothing if the prompt does not fit the model */
+static int bench_run(struct bench_cfg *cfg, struct iimc_gpt2 *m,
+		int threads, int b, int t, int first)
+{
+	int steps = cfg->steps;
+	if (t >= m->cfg.max_seq_len)
+		return 0;
+	if (t + steps > m->cfg.max_seq_len)
+		steps = m->cfg.max_seq_len - t;
+
+	if (iimc_gpt2_init(m, b, t + steps) != IIMC_ENONE) {
+		fprintf(stderr, "Failed to init model for batch %d and"
+				" length %d.\n", b, t);
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned long long state = cfg->seed;
+	int *in = malloc((size_t) b * t * sizeof(int));
+	double *step_ms = malloc(steps * sizeof(double));
+	if (in == NULL || step_ms == NULL) {
+		fprintf(stderr, "Failed to allocate benchmark buffers.\n");
+		exit(EXIT_FAILURE);
+	}
+	random_tokens(in, b * t, m->cfg.vocab_size, &state);
+
+	iimc_gpt2_prefill(m, in, b, t);
+	iimc_gpt2_prof_reset(m);
+
+	double start = now_ms();
+	iimc_gpt2_prefill(m, in, b, t);
+	double prefill_ms = now_ms() - start;
+
+	double decode_ms = 0.0;
+	int i;
+	for (i = 0; i < steps; i++) {
+		random_tokens(in, b, m->cfg.vocab_size, &state);
+		start = now_ms();
+		iimc_gpt2_decode(m, in, b);
+		step_ms[i] = now_ms() - start;
+		decode_ms += step_ms[i];
+	}
+	qsort(step_ms, steps, sizeof(double), cmp_double);
+
+	printf("%s\n    {\"threads\": %d, \"batch\": %d, \"seq_len\": %d, "
+			"\"prefill_ms\": %.3f, \"prefill_tok_s\": %.1f, "
+			"\"decode_steps\": %d, \"decode_tok_s\": %.1f, "
+			"\"step_p50_ms\": %.3f, \"step_p99_ms\": %.3f",
+			first ? "" : ",", threads, b, t, prefill_ms,
+			b * t / prefill_ms * 1e3, steps,
+			steps > 0 ? b * steps / decode_ms * 1e3 : 0.0,
+			steps > 0 ? percentile(step_ms, steps, 0.5) : 0.0,
+			steps > 0 ? percentile(step_ms, steps, 0.99) : 0.0);
+	if (cfg->profile)
+		print_ops(m);
+	printf("}");
+	fflush(stdout);
+
+	free(step_ms);
+	free(in);
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_cfg cfg;
+	struct iimc_gpt2 *m;
+	int r;
+
+	bench_default(&cfg);
+	parse_cmd(argc, argv, &cfg);
+
+	m = iimc_gpt2_new();
+	if (m == NULL) {
+		fprintf(stderr, "Failed to allocate memory for model. "
+				"Likely out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (cfg.mf != NULL)
+		r = iimc_gpt2_load_mmap(m, cfg.mf, IIMC_MMAP_POPULATE);
+	else
+		r = iimc_gpt2_random(m, cfg.max_seq_len, cfg.vocab_size,
+				cfg.num_layers, cfg.num_heads, cfg.channels,
+				cfg.seed);
+	if (r != IIMC_ENONE) {
+		fprintf(stderr, "Failed to load model.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (cfg.dtype != IIMC_DTYPE_F32 &&
+			iimc_gpt2_quantize(m, cfg.dtype) != IIMC_ENONE) {
+		fprintf(stderr, "Failed to quantize model.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (iimc_gpt2_numa(m, cfg.numa) != IIMC_ENONE) {
+		fprintf(stderr, "Failed to place model on the NUMA nodes.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	m->output = IIMC_OUTPUT_LAST | IIMC_OUTPUT_LOGITS;
+	m->profile = cfg.profile;
+
+	printf("{\n  \"model\": {\"file\": ");
+	if (cfg.mf != NULL)
+		printf("\"%s\"", cfg.mf);
+	else
+		printf("null");
+	printf(", \"max_seq_len\": %d, \"vocab_size\": %d, "
+			"\"num_layers\": %d, \"num_heads\": %d, "
+			"\"channels\": %d, \"dtype\": \"%s\"},\n"
+			"  \"results\": [",
+			m->cfg.max_seq_len, m->cfg.vocab_size,
+			m->cfg.num_layers, m->cfg.num_heads,
+			m->cfg.channels, dtype_name(m->dtype));
+
+	int first = 1;
+	int i, j, k;
+	for (i = 0; i < cfg.n_threads; i++) {
+		m->pool = iimc_pool_new(cfg.threads[i], NULL);
+		if (m->pool == NULL) {
+			fprintf(stderr, "Failed to start %d threads.\n",
+					cfg.threads[i]);
+			exit(EXIT_FAILURE);
+		}
+		for (j = 0; j < cfg.n_batch; j++)
+			for (k = 0; k < cfg.n_seq_len; k++)
+				if (bench_run(&cfg, m, cfg.threads[i],
+						cfg.batch[j],
+						cfg.seq_len[k], first))
+					first = 0;
+		iimc_pool_free(m->pool);
+		m->pool = NULL;
+	}
+
+	printf("\n  ]\n}\n");
+
+	iimc_gpt2_free(m);
+	return 0;
+}
@@ -6,11 +6,27 @@
 
 #include "iimc.h"
 
+/*
+ * The first eight bytes of a token are kept in the table itself, so a probe
+ * only reads dec for longer tokens. id -1 marks an empty slot.
+ */
+struct bpe_entry {
+	unsigned long long key;
+	int id;
+	int len;
+};
+
 struct iimc_bpe {
 	unsigned int vocab_count;
 	size_t max_word_size;
 	size_t dec_size;
 	char *dec;
+	unsigned char *len;
+
+	/* open addressing table from token bytes to token id */
+	unsigned int enc_mask;
+	struct bpe_entry *enc;
+	int byte_id[256];
 };
 
 struct iimc_bpe *iimc_bpe_new(void)
@@ -31,7 +47,14 @@ int iimc_bpe_free(struct iimc_bpe *p)
 	if (p->dec != NULL)
 		free(p->dec);
 
+	if (p->len != NULL)
+		free(p->len);
+
+	if (p->enc != NULL)
+		free(p->enc);
+
 	memset(p, 0, sizeof(struct iimc_bpe));
+	free(p);
 	return IIMC_ENONE;
 }
 
@@ -76,6 +99,83 @@ static int bpe_load_data(struct iimc_bpe *t, FILE *stream)
 
 		if (fread(&t->dec[i * t->max_word_size], 1, size, stream) != size)
 			return IIMC_EFILE_BAD_TOKENS;
+		t->len[i] = size;
+	}
+
+	return IIMC_ENONE;
+}
+
+static inline unsigned int bpe_hash(const char *s, size_t n)
+{
+	/* FNV-1a */
+	unsigned int h = 2166136261u;
+	size_t i;
+	for (i = 0; i < n; i++) {
+		h ^= (unsigned char) s[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static inline unsigned long long bpe_key(const char *s, size_t n)
+{
+	unsigned long long key = 0;
+	if (n >= 8) {
+		memcpy(&key, s, 8);
+	} else {
+		size_t i;
+		for (i = 0; i < n; i++)
+			key |= (unsigned long long) (unsigned char) s[i] << (8 * i);
+	}
+	return key;
+}
+
+static int bpe_lookup(struct iimc_bpe *t, const char *s, size_t n)
+{
+	unsigned long long key = bpe_key(s, n);
+	unsigned int h = bpe_hash(s, n) & t->enc_mask;
+	for (;;) {
+		struct bpe_entry *e = &t->enc[h];
+		if (e->id < 0)
+			return -1;
+		if (e->len == n && e->key == key && (n <= 8 ||
+				memcmp(&t->dec[e->id * t->max_word_size + 8],
+					s + 8, n - 8) == 0))
+			return e->id;
+		h = (h + 1) & t->enc_mask;
+	}
+}
+
+static int bpe_build_enc(struct iimc_bpe *t)
+{
+	unsigned int size = 1;
+	while (size < 2 * t->vocab_count)
+		size <<= 1;
+
+	t->enc = malloc(size * sizeof(struct bpe_entry));
+	if (t->enc == NULL)
+		return IIMC_ENOMEM;
+
+	unsigned int i;
+	for (i = 0; i < size; i++)
+		t->enc[i].id = -1;
+	t->enc_mask = size - 1;
+
+	for (i = 0; i < t->vocab_count; i++) {
+		const char *s = &t->dec[i * t->max_word_size];
+		if (t->len[i] == 0 || bpe_lookup(t, s, t->len[i]) >= 0)
+			continue;
+		unsigned int h = bpe_hash(s, t->len[i]) & t->enc_mask;
+		while (t->enc[h].id >= 0)
+			h = (h + 1) & t->enc_mask;
+		t->enc[h].key = bpe_key(s, t->len[i]);
+		t->enc[h].id = i;
+		t->enc[h].len = t->len[i];
+	}
+
+	for (i = 0; i < 256; i++) {
+		char c = i;
+		t->byte_id[i] = bpe_lookup(t, &c, 1);
 	}
 
 	return IIMC_ENONE;
@@ -87,20 +187,35 @@ int iimc_bpe_load(struct iimc_bpe *t, const char *model)
 	if (stream == NULL)
 		return IIMC_EFILE_NOT_FOUND;
 
-	bpe_load_header(t, stream);
+	int r;
+	r = bpe_load_header(t, stream);
+	if (r != IIMC_ENONE) {
+		fclose(stream);
+		return r;
+	}
 
-	t->dec = malloc(t->dec_size);
-	if (t->dec == NULL) {
+	t->dec = calloc(t->dec_size, 1);
+	t->len = calloc(t->vocab_count, 1);
+	if (t->dec == NULL || t->len == NULL) {
+		free(t->dec);
+		free(t->len);
+		t->dec = NULL;
+		t->len = NULL;
 		fclose(stream);
 		return IIMC_ENOMEM;
 	}
 
-	int r;
 	r = bpe_load_data(t, stream);
 	fclose(stream);
 
+	if (r == IIMC_ENONE)
+		r = bpe_build_enc(t);
+
 	if (r != IIMC_ENONE) {
 		free(t->dec);
+		free(t->len);
+		t->dec = NULL;
+		t->len = NULL;
 		return r;
 	}
 
@@ -110,8 +225,219 @@ int iimc_bpe_load(struct iimc_bpe *t, const char *model)
 char *iimc_bpe_decode(struct iimc_bpe *t, int value)
 {
 	assert(t != NULL);
-	if (value < 0 || value > t->dec_size)
+	if (value < 0 || value >= t->vocab_count)
 		return NULL;
 
 	return &t->dec[value * t->max_word_size];
 }
+
+/*
+ * GPT-2 pre-tokenization, the regular expression
+ *   's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+ * written out by hand. Bytes of multi-byte UTF-8 sequences count as letters.
+ * Returns the end of the chunk starting at i.
+ */
+enum { BPE_SPACE, BPE_LETTER, BPE_DIGIT, BPE_OTHER };
+
+static int bpe_class(unsigned char c)
+{
+	if (c == ' ' || (c >= '\t' && c <= '\r'))
+		return BPE_SPACE;
+	if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80)
+		return BPE_LETTER;
+	if (c >= '0' && c <= '9')
+		return BPE_DIGIT;
+	return BPE_OTHER;
+}
+
+static size_t bpe_split(const char *text, size_t n, size_t i)
+{
+	static const char *contractions[] = {
+		"'s", "'t", "'re", "'ve", "'m", "'ll", "'d"
+	};
+	size_t j, k;
+
+	if (text[i] == '\'') {
+		for (k = 0; k < sizeof(contractions) / sizeof(char *); k++) {
+			size_t l = strlen(contractions[k]);
+			if (i + l <= n && memcmp(text + i, contractions[k], l) == 0)
+				return i + l;
+		}
+	}
+
+	j = i;
+	if (text[j] == ' ' && j + 1 < n && bpe_class(text[j + 1]) != BPE_SPACE)
+		j++;
+
+	int c = bpe_class(text[j]);
+	if (c != BPE_SPACE) {
+		while (j < n && bpe_class(text[j]) == c)
+			j++;
+		return j;
+	}
+
+	/* a whitespace run leaves its last character to the next word */
+	for (k = i; k < n && bpe_class(text[k]) == BPE_SPACE; k++)
+		;
+	if (k < n && k - i > 1)
+		return k - 1;
+	return k;
+}
+
+struct bpe_pair {
+	int rank;
+	int left;
+	int right;
+	int size;
+};
+
+static int bpe_pair_less(struct bpe_pair *a, struct bpe_pair *b)
+{
+	return a->rank < b->rank || (a->rank == b->rank && a->left < b->left);
+}
+
+static void bpe_heap_push(struct bpe_pair *h, int *n, struct bpe_pair p)
+{
+	int i = (*n)++;
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (!bpe_pair_less(&p, &h[parent]))
+			break;
+		h[i] = h[parent];
+		i = parent;
+	}
+	h[i] = p;
+}
+
+static struct bpe_pair bpe_heap_pop(struct bpe_pair *h, int *n)
+{
+	struct bpe_pair top = h[0];
+	struct bpe_pair last = h[--(*n)];
+	int i = 0;
+	for (;;) {
+		int l = 2 * i + 1;
+		int min = l;
+		if (l >= *n)
+			break;
+		if (l + 1 < *n && bpe_pair_less(&h[l + 1], &h[l]))
+			min = l + 1;
+		if (!bpe_pair_less(&h[min], &last))
+			break;
+		h[i] = h[min];
+		i = min;
+	}
+	h[i] = last;
+	return top;
+}
+
+struct bpe_work {
+	int *start, *size, *next, *prev, *id;
+	struct bpe_pair *heap;
+};
+
+/*
+ * The merge rank of two adjacent parts. GPT-2 token ids follow the merge
+ * order, so the rank of a merge is the id of the merged token.
+ */
+static void bpe_push_pair(struct iimc_bpe *t, struct bpe_work *w,
+		const char *text, int *nheap, int left, int right)
+{
+	if (left < 0 || right < 0)
+		return;
+
+	int size = w->size[left] + w->size[right];
+	int id = bpe_lookup(t, text + w->start[left], size);
+	if (id < 0 || id == GPT2_EOT)
+		return;
+
+	struct bpe_pair p = { id, left, right, size };
+	bpe_heap_push(w->heap, nheap, p);
+}
+
+/* byte pair encoding of one pre-tokenized chunk */
+static int bpe_encode_chunk(struct iimc_bpe *t, struct bpe_work *w,
+		const char *text, int n, int *out)
+{
+	int i, nheap = 0;
+
+	for (i = 0; i < n; i++) {
+		w->id[i] = t->byte_id[(unsigned char) text[i]];
+		if (w->id[i] < 0)
+			return -1;
+		w->start[i] = i;
+		w->size[i] = 1;
+		w->prev[i] = i - 1;
+		w->next[i] = (i + 1 < n) ? i + 1 : -1;
+	}
+	for (i = 0; i + 1 < n; i++)
+		bpe_push_pair(t, w, text, &nheap, i, i + 1);
+
+	while (nheap > 0) {
+		struct bpe_pair p = bpe_heap_pop(w->heap, &nheap);
+
+		/* skip pairs whose parts have changed since the push */
+		if (w->size[p.left] == 0 || w->next[p.left] != p.right ||
+				w->size[p.left] + w->size[p.right] != p.size)
+			continue;
+
+		w->size[p.left] = p.size;
+		w->size[p.right] = 0;
+		w->id[p.left] = p.rank;
+		w->next[p.left] = w->next[p.right];
+		if (w->next[p.right] >= 0)
+			w->prev[w->next[p.right]] = p.left;
+
+		bpe_push_pair(t, w, text, &nheap, w->prev[p.left], p.left);
+		bpe_push_pair(t, w, text, &nheap, p.left, w->next[p.left]);
+	}
+
+	int count = 0;
+	for (i = 0; i >= 0; i = w->next[i])
+		out[count++] = w->id[i];
+	return count;
+}
+
+/*
+ * Encodes n bytes of text into GPT-2 tokens. out must have room for n
+ * tokens, there is never more than one token per byte. Returns the number
+ * of tokens, or -1 when a byte has no token.
+ */
+int iimc_bpe_encode(struct iimc_bpe *t, const char *text, size_t n, int *out)
+{
+	assert(t != NULL);
+	assert(t->enc != NULL);
+	assert(text != NULL);
+	assert(out != NULL);
+
+	if (n == 0)
+		return 0;
+
+	struct bpe_work w;
+	w.start = malloc(5 * n * sizeof(int));
+	w.heap = malloc(3 * n * sizeof(struct bpe_pair));
+	if (w.start == NULL || w.heap == NULL) {
+		free(w.start);
+		free(w.heap);
+		return -1;
+	}
+	w.size = w.start + n;
+	w.next = w.size + n;
+	w.prev = w.next + n;
+	w.id = w.prev + n;
+
+	int count = 0;
+	size_t i, j;
+	for (i = 0; i < n; i = j) {
+		j = bpe_split(text, n, i);
+		int r = bpe_encode_chunk(t, &w, text + i, j - i, out + count);
+		if (r < 0) {
+			count = -1;
+			break;
+		}
+		count += r;
+	}
+
+	free(w.start);
+	free(w.heap);
+	return count;
+}
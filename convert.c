@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "iimc.h"
+
+static void print_help()
+{
+	 printf("Usage: iimc-convert [OPTION]... INPUT OUTPUT\n"
+		"Rewrite an fp32 GPT2 model file with bf16 parameters.\n\n"
+		"  -h\t\tdisplay this help and exit\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct iimc_gpt2 *m;
+	int opt;
+	int r;
+
+	while ((opt = getopt(argc, argv, "h")) != -1) {
+		switch (opt) {
+			case 'h':
+				print_help();
+				exit(EXIT_SUCCESS);
+			default:
+				print_help();
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (argc - optind != 2) {
+		print_help();
+		exit(EXIT_FAILURE);
+	}
+
+	m = iimc_gpt2_new();
+	if (m == NULL) {
+		fprintf(stderr, "Failed to allocate memory for model. "
+				"Likely out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	r = iimc_gpt2_load_mmap(m, argv[optind], 0);
+	if (r != IIMC_ENONE) {
+		fprintf(stderr, "Failed to load model %s.\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	r = iimc_gpt2_quantize(m, IIMC_DTYPE_BF16);
+	if (r != IIMC_ENONE) {
+		fprintf(stderr, "Failed to convert model.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	r = iimc_gpt2_save(m, argv[optind + 1]);
+	if (r != IIMC_ENONE) {
+		fprintf(stderr, "Failed to write model %s.\n",
+				argv[optind + 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	iimc_gpt2_free(m);
+	return 0;
+}
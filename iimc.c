@@ -1,9 +1,27 @@
+#ifdef IIMC_NUMA
+#define _GNU_SOURCE	/* sched_getcpu */
+#endif
+
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+#ifdef IIMC_NUMA
+#include <sched.h>
+#include <stdint.h>
+#include <numa.h>
+#include <numaif.h>
+#endif
 
 #include "iimc.h"
 
@@ -17,46 +35,182 @@ struct iimc_gpt2 *iimc_gpt2_new(void)
 	return m;
 }
 
+static const char *op_names[IIMC_NUM_OPS] = {
+	"encoder", "layernorm", "qkv", "attproj", "fc", "fcproj", "lm_head",
+	"attention", "softmax", "sample"
+};
+
+const char *iimc_op_name(int op)
+{
+	assert(op >= 0 && op < IIMC_NUM_OPS);
+	return op_names[op];
+}
+
+static unsigned long long clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+unsigned long long iimc_prof_now(void)
+{
+#ifdef IIMC_PROFILE
+	return clock_ns();
+#else
+	return 0;
+#endif
+}
+
+void iimc_gpt2_prof_add(struct iimc_gpt2 *m, int op, unsigned long long start,
+		double flops, double bytes)
+{
+#ifdef IIMC_PROFILE
+	if (!m->profile)
+		return;
+
+	struct iimc_prof *p = &m->prof[op];
+	p->calls++;
+	p->ns += iimc_prof_now() - start;
+	p->flops += flops;
+	p->bytes += bytes;
+#endif
+}
+
+void iimc_gpt2_prof_reset(struct iimc_gpt2 *m)
+{
+	memset(m->prof, 0, sizeof(m->prof));
+}
+
+/*
+ * Timers around the kernels of the forward pass. They cost two
+ * clock_gettime calls per op while m->profile is set and nothing at all
+ * without IIMC_PROFILE.
+ */
+static inline unsigned long long prof_start(struct iimc_gpt2 *m)
+{
+#ifdef IIMC_PROFILE
+	if (m->profile)
+		return iimc_prof_now();
+#endif
+	return 0;
+}
+
+static inline void prof_stop(struct iimc_gpt2 *m, int op,
+		unsigned long long start, double flops, double bytes)
+{
+#ifdef IIMC_PROFILE
+	iimc_gpt2_prof_add(m, op, start, flops, bytes);
+#endif
+}
+
+static int model_params_mapped(struct iimc_gpt2 *m)
+{
+	char *p = (char *) m->params;
+	char *map = m->map;
+	return map != NULL && p >= map && p < map + m->map_bytes;
+}
+
+static void model_numa_free(struct iimc_gpt2 *m);
+
 int iimc_gpt2_free(struct iimc_gpt2 *m)
 {
 	if (m == NULL) 
 		return IIMC_ENULL_POINTER_FREE;
 
-	if (m->params != NULL)
+	if (m->params != NULL && !model_params_mapped(m))
 		free(m->params);
 
+	if (m->map != NULL)
+		munmap(m->map, m->map_bytes);
+
+	if (m->qparams != NULL)
+		free(m->qparams);
+
 	if (m->acts != NULL)
 		free(m->acts);
 
+	if (m->kv.k != NULL)
+		free(m->kv.k);
+
+	if (m->kv.len != NULL)
+		free(m->kv.len);
+
+	model_numa_free(m);
+
 	memset(m, 0, sizeof(struct iimc_gpt2));
 	free(m);
 	return IIMC_ENONE;
 }
 
-static int model_load_header(struct iimc_gpt2 *m, FILE *mf)
+/*
+ * Packed files, written by iimc_gpt2_save after iimc_gpt2_pack, keep the
+ * llm.c header with version 4. header[7] is the dtype of the matmul
+ * weights, header[8] the layout revision PACK_VERSION and header[9] and
+ * header[10] the panel shape, so a file packed for another layout is
+ * refused instead of misread.
+ *
+ * qkvw, attprojw, fcw and fcprojw are stored layer by layer in panels of
+ * PACK_ROWS output channels, the three of matmul_tile_4x3. A panel holds
+ * its rows interleaved PACK_K values at a time, in the order the tile
+ * reads them, so the kernel streams one sequential run of weights instead
+ * of PACK_ROWS rows c values apart. The last panel of a layer is padded
+ * with zero rows. wte keeps its rows, the encoder looks them up, and all
+ * other tensors are fp32. Every tensor starts 64 byte aligned.
+ */
+#define PACK_VERSION	1
+#define PACK_ROWS	3
+#define PACK_K		8
+
+static int model_parse_header(struct iimc_gpt2 *m, int *header)
 {
 	assert(m != NULL);
-	assert(mf != NULL);
-
-	int header[256];
-	if (fread(header, sizeof(header), 1, mf) != 1)
-		return IIMC_EFILE_BAD_HEADER;
+	assert(header != NULL);
 
 	if (header[0] != 20240326) 
 		return IIMC_EFILE_BAD_HEADER;
 
-	if (header[1] != 1)
+	/* version 3 stores every parameter in bf16, version 4 is packed */
+	if (header[1] != 1 && header[1] != 3 && header[1] != 4)
 		return IIMC_EFILE_BAD_HEADER;
 
+	m->dtype = (header[1] == 3) ? IIMC_DTYPE_BF16 : IIMC_DTYPE_F32;
+	m->packed = 0;
+
+	if (header[1] == 4) {
+		if (header[7] != IIMC_DTYPE_F32 && header[7] != IIMC_DTYPE_BF16)
+			return IIMC_EFILE_BAD_HEADER;
+		if (header[8] != PACK_VERSION || header[9] != PACK_ROWS ||
+				header[10] != PACK_K)
+			return IIMC_EFILE_BAD_HEADER;
+		m->dtype = header[7];
+		m->packed = 1;
+	}
+
 	m->cfg.max_seq_len	= header[2];
 	m->cfg.vocab_size	= header[3];
 	m->cfg.num_layers	= header[4];
 	m->cfg.num_heads	= header[5];
 	m->cfg.channels		= header[6];
 
+	if (m->packed && m->cfg.channels % PACK_K != 0)
+		return IIMC_EFILE_BAD_HEADER;
+
 	return IIMC_ENONE;
 }
 
+static int model_load_header(struct iimc_gpt2 *m, FILE *mf)
+{
+	assert(m != NULL);
+	assert(mf != NULL);
+
+	int header[256];
+	if (fread(header, sizeof(header), 1, mf) != 1)
+		return IIMC_EFILE_BAD_HEADER;
+
+	return model_parse_header(m, header);
+}
+
 static size_t model_count_param(struct iimc_gpt2 *m)
 {
 	assert(m != NULL);
@@ -104,6 +258,250 @@ static size_t model_load_param_sizes(struct iimc_gpt2 *m)
 	return m->param_count;
 }
 
+static void model_set_params(struct iimc_gpt2 *m)
+{
+	assert(m != NULL);
+
+	float *p = m->params;
+	m->param.wte = p;
+	p += m->param_size[ 0]; m->param.wpe = p;
+	p += m->param_size[ 1]; m->param.ln1w = p;
+	p += m->param_size[ 2]; m->param.ln1b = p;
+	p += m->param_size[ 3]; m->param.qkvw = p;
+	p += m->param_size[ 4]; m->param.qkvb = p;
+	p += m->param_size[ 5]; m->param.attprojw = p;
+	p += m->param_size[ 6]; m->param.attprojb = p;
+	p += m->param_size[ 7]; m->param.ln2w = p;
+	p += m->param_size[ 8]; m->param.ln2b = p;
+	p += m->param_size[ 9]; m->param.fcw = p;
+	p += m->param_size[10]; m->param.fcb = p;
+	p += m->param_size[11]; m->param.fcprojw = p;
+	p += m->param_size[12]; m->param.fcprojb = p;
+	p += m->param_size[13]; m->param.lnfw = p;
+	p += m->param_size[14]; m->param.lnfb = p;
+}
+
+static inline float bf16_to_f32(unsigned short h)
+{
+	union { unsigned int u; float f; } v = { .u = (unsigned int) h << 16 };
+	return v.f;
+}
+
+static inline unsigned short f32_to_bf16(float f)
+{
+	union { float f; unsigned int u; } v = { .f = f };
+
+	/* keep NaN a NaN, otherwise round to nearest even */
+	if ((v.u & 0x7fffffff) > 0x7f800000)
+		return (v.u >> 16) | 0x40;
+	return (v.u + 0x7fff + ((v.u >> 16) & 1)) >> 16;
+}
+
+/*
+ * base holds all tensors in bf16 and in checkpoint order. The matmul weights
+ * are used in place, the other tensors are widened into a compact fp32
+ * parameter block.
+ */
+static int model_set_params_bf16(struct iimc_gpt2 *m, unsigned short *base)
+{
+	assert(m != NULL);
+	assert(base != NULL);
+
+	float **ptrs[NUM_PARAMETER_TENSORS] = {
+		&m->param.wte, &m->param.wpe, &m->param.ln1w, &m->param.ln1b,
+		&m->param.qkvw, &m->param.qkvb, &m->param.attprojw,
+		&m->param.attprojb, &m->param.ln2w, &m->param.ln2b,
+		&m->param.fcw, &m->param.fcb, &m->param.fcprojw,
+		&m->param.fcprojb, &m->param.lnfw, &m->param.lnfb
+	};
+	unsigned short **hptrs[NUM_PARAMETER_TENSORS] = {
+		[ 0] = &m->hparam.wte,
+		[ 4] = &m->hparam.qkvw,
+		[ 6] = &m->hparam.attprojw,
+		[10] = &m->hparam.fcw,
+		[12] = &m->hparam.fcprojw
+	};
+
+	size_t count = 0;
+	int i;
+	for (i = 0; i < NUM_PARAMETER_TENSORS; i++)
+		if (hptrs[i] == NULL)
+			count += m->param_size[i];
+
+	float *params;
+	int r = posix_memalign((void **) &params, 64, count * sizeof(float));
+	switch (r) {
+		case 0:
+			break;
+		case ENOMEM:
+			return IIMC_ENOMEM;
+		default:
+			return IIMC_EUNKNOWN;
+	}
+
+	float *p = params;
+	unsigned short *h = base;
+	for (i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+		size_t k, n = m->param_size[i];
+		if (hptrs[i] != NULL) {
+			*hptrs[i] = h;
+			*ptrs[i] = NULL;
+		} else {
+			for (k = 0; k < n; k++)
+				p[k] = bf16_to_f32(h[k]);
+			*ptrs[i] = p;
+			p += n;
+		}
+		h += n;
+	}
+
+	m->params = params;
+	m->param_count = count;
+	m->param_bytes = count * sizeof(float);
+
+	return IIMC_ENONE;
+}
+
+/* output channels of a packed weight rounded up to whole panels */
+static inline size_t pack_rows(size_t oc)
+{
+	return (oc + PACK_ROWS - 1) / PACK_ROWS * PACK_ROWS;
+}
+
+/* offset of w[j][k] from the start of the panel that holds row j */
+static inline size_t pack_at(int j, int k)
+{
+	return (size_t) (k / PACK_K) * PACK_K * PACK_ROWS + j * PACK_K +
+		k % PACK_K;
+}
+
+/* bytes[i] of every tensor in the packed layout, returns their sum */
+static size_t model_pack_sizes(struct iimc_gpt2 *m, size_t *bytes)
+{
+	assert(m != NULL);
+
+	size_t c = m->cfg.channels;
+	size_t l = m->cfg.num_layers;
+	size_t h = (m->dtype == IIMC_DTYPE_BF16) ?
+		sizeof(unsigned short) : sizeof(float);
+	size_t total = 0;
+	int i;
+
+	for (i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+		size_t n = m->param_size[i] * sizeof(float);
+		switch (i) {
+			case 0:
+				n = m->param_size[i] * h;
+				break;
+			case 4:
+				n = l * pack_rows(3 * c) * c * h;
+				break;
+			case 6:
+				n = l * pack_rows(c) * c * h;
+				break;
+			case 10:
+				n = l * pack_rows(4 * c) * c * h;
+				break;
+			case 12:
+				n = l * pack_rows(c) * 4 * c * h;
+				break;
+		}
+		bytes[i] = (n + 63) & ~(size_t) 63;
+		total += bytes[i];
+	}
+
+	return total;
+}
+
+/* points the tensors of m into base, which holds them packed */
+static void model_set_params_packed(struct iimc_gpt2 *m, char *base)
+{
+	assert(m != NULL);
+	assert(base != NULL);
+
+	float **ptrs[NUM_PARAMETER_TENSORS] = {
+		&m->param.wte, &m->param.wpe, &m->param.ln1w, &m->param.ln1b,
+		&m->param.qkvw, &m->param.qkvb, &m->param.attprojw,
+		&m->param.attprojb, &m->param.ln2w, &m->param.ln2b,
+		&m->param.fcw, &m->param.fcb, &m->param.fcprojw,
+		&m->param.fcprojb, &m->param.lnfw, &m->param.lnfb
+	};
+	unsigned short **hptrs[NUM_PARAMETER_TENSORS] = {
+		[ 0] = &m->hparam.wte,
+		[ 4] = &m->hparam.qkvw,
+		[ 6] = &m->hparam.attprojw,
+		[10] = &m->hparam.fcw,
+		[12] = &m->hparam.fcprojw
+	};
+	size_t bytes[NUM_PARAMETER_TENSORS];
+	int i;
+
+	model_update_param_count(m);
+	m->params = (float *) base;
+	m->param_bytes = model_pack_sizes(m, bytes);
+
+	for (i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+		if (m->dtype == IIMC_DTYPE_BF16 && hptrs[i] != NULL) {
+			*hptrs[i] = (unsigned short *) base;
+			*ptrs[i] = NULL;
+		} else {
+			*ptrs[i] = (float *) base;
+		}
+		base += bytes[i];
+	}
+}
+
+static int model_load_params_packed(struct iimc_gpt2 *m, FILE *mf)
+{
+	assert(m != NULL);
+	assert(mf != NULL);
+
+	size_t bytes[NUM_PARAMETER_TENSORS];
+	size_t n = model_pack_sizes(m, bytes);
+	void *base;
+	int r = posix_memalign(&base, 64, n);
+	switch (r) {
+		case 0:
+			break;
+		case ENOMEM:
+			return IIMC_ENOMEM;
+		default:
+			return IIMC_EUNKNOWN;
+	}
+
+	if (fread(base, n, 1, mf) != 1) {
+		free(base);
+		return IIMC_EFILE_BAD_PARAMS;
+	}
+
+	model_set_params_packed(m, base);
+	return IIMC_ENONE;
+}
+
+static int model_load_params_bf16(struct iimc_gpt2 *m, FILE *mf)
+{
+	assert(m != NULL);
+	assert(mf != NULL);
+
+	m->qparam_bytes = m->param_count * sizeof(unsigned short);
+	int r = posix_memalign(&m->qparams, 64, m->qparam_bytes);
+	switch (r) {
+		case 0:
+			break;
+		case ENOMEM:
+			m->qparams = NULL;
+			return IIMC_ENOMEM;
+		default:
+			m->qparams = NULL;
+			return IIMC_EUNKNOWN;
+	}
+
+	if (fread(m->qparams, m->qparam_bytes, 1, mf) != 1)
+		return IIMC_EFILE_BAD_PARAMS;
+
+	return model_set_params_bf16(m, m->qparams);
+}
+
 static int model_load_params_new(struct iimc_gpt2 *m)
 {
 	assert(m != NULL);
@@ -131,23 +529,7 @@ static int model_load_params_new(struct iimc_gpt2 *m)
 			return IIMC_EUNKNOWN;
 	}
 
-	float *p = m->params;
-	m->param.wte = p;
-	p += m->param_size[ 0]; m->param.wpe = p;
-	p += m->param_size[ 1]; m->param.ln1w = p;
-	p += m->param_size[ 2]; m->param.ln1b = p;
-	p += m->param_size[ 3]; m->param.qkvw = p;
-	p += m->param_size[ 4]; m->param.qkvb = p;
-	p += m->param_size[ 5]; m->param.attprojw = p;
-	p += m->param_size[ 6]; m->param.attprojb = p;
-	p += m->param_size[ 7]; m->param.ln2w = p;
-	p += m->param_size[ 8]; m->param.ln2b = p;
-	p += m->param_size[ 9]; m->param.fcw = p;
-	p += m->param_size[10]; m->param.fcb = p;
-	p += m->param_size[11]; m->param.fcprojw = p;
-	p += m->param_size[12]; m->param.fcprojb = p;
-	p += m->param_size[13]; m->param.lnfw = p;
-	p += m->param_size[14]; m->param.lnfb = p;
+	model_set_params(m);
 
 	return IIMC_ENONE;
 }
@@ -172,6 +554,20 @@ static int model_load_params(struct iimc_gpt2 *m, FILE *mf)
 	return IIMC_ENONE;
 }
 
+/* drops the parameter buffers of a load that failed half way */
+static void model_params_free(struct iimc_gpt2 *m)
+{
+	assert(m != NULL);
+
+	if (m->params != NULL && !model_params_mapped(m))
+		free(m->params);
+	m->params = NULL;
+
+	if (m->qparams != NULL)
+		free(m->qparams);
+	m->qparams = NULL;
+}
+
 int iimc_gpt2_load(struct iimc_gpt2 *m, const char *path)
 {
 	assert(m != NULL);
@@ -193,9 +589,26 @@ int iimc_gpt2_load(struct iimc_gpt2 *m, const char *path)
 
 	int r;
 
+	if (m->packed) {
+		r = model_load_params_packed(m, mf);
+		fclose(mf);
+		if (r != IIMC_ENONE)
+			model_params_free(m);
+		return r;
+	}
+
+	if (m->dtype == IIMC_DTYPE_BF16) {
+		r = model_load_params_bf16(m, mf);
+		fclose(mf);
+		if (r != IIMC_ENONE)
+			model_params_free(m);
+		return r;
+	}
+
 	r = model_load_params_new(m);
 	if (r != IIMC_ENONE) {
 		fclose(mf);
+		model_params_free(m);
 		free(m);
 		return r;
 	}
@@ -203,6 +616,7 @@ int iimc_gpt2_load(struct iimc_gpt2 *m, const char *path)
 	r = model_load_params(m, mf);
 	if (r != IIMC_ENONE) {
 		fclose(mf);
+		model_params_free(m);
 		free(m);
 		return r;
 	}
@@ -212,468 +626,3654 @@ int iimc_gpt2_load(struct iimc_gpt2 *m, const char *path)
 	return IIMC_ENONE;
 }
 
-static int model_init_acts_new(struct iimc_gpt2 *m)
+/*
+ * Maps the model file instead of reading it. m->params then points into the
+ * page cache, so loading costs no copy and every process that maps the same
+ * file shares one physical copy of the weights. The mapping is read-only.
+ */
+int iimc_gpt2_load_mmap(struct iimc_gpt2 *m, const char *path, int flags)
 {
 	assert(m != NULL);
+	assert(path != NULL);
+	assert(m->params == NULL);
 
-	if (m->acts != NULL)
-		free(m->acts);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return IIMC_EFILE_NOT_FOUND;
 
-	int r = posix_memalign((void **) &m->acts, 64, m->act_bytes);
-	switch (r) {
-		case 0:
-			break;
-		case ENOMEM:
-			return IIMC_ENOMEM;
-		default:
-			return IIMC_EUNKNOWN;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < 256 * sizeof(int)) {
+		close(fd);
+		return IIMC_EFILE_BAD_HEADER;
 	}
 
-	float *p = m->acts;
-	m->act.encoded = p;
-	p += m->act_size[ 0]; m->act.ln1 = p;
-	p += m->act_size[ 1]; m->act.ln1_mean = p;
-	p += m->act_size[ 2]; m->act.ln1_rstd = p;
-	p += m->act_size[ 3]; m->act.qkv = p;
-	p += m->act_size[ 4]; m->act.atty = p;
-	p += m->act_size[ 5]; m->act.preatt = p;
-	p += m->act_size[ 6]; m->act.att = p;
-	p += m->act_size[ 7]; m->act.attproj = p;
-	p += m->act_size[ 8]; m->act.residual2 = p;
-	p += m->act_size[ 9]; m->act.ln2 = p;
-	p += m->act_size[10]; m->act.ln2_mean = p;
-	p += m->act_size[11]; m->act.ln2_rstd = p;
-	p += m->act_size[12]; m->act.fch = p;
-	p += m->act_size[13]; m->act.fch_gelu = p;
-	p += m->act_size[14]; m->act.fcproj = p;
-	p += m->act_size[15]; m->act.residual3 = p;
-	p += m->act_size[16]; m->act.lnf = p;
-	p += m->act_size[17]; m->act.lnf_mean = p;
-	p += m->act_size[18]; m->act.lnf_rstd = p;
-	p += m->act_size[19]; m->act.logits = p;
-	p += m->act_size[20]; m->act.probs = p;
-	p += m->act_size[21]; m->act.losses = p;
+	int mflags = MAP_SHARED;
+	if (flags & IIMC_MMAP_POPULATE)
+		mflags |= MAP_POPULATE;
 
-	return IIMC_ENONE;
-}
+	void *map = mmap(NULL, st.st_size, PROT_READ, mflags, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return IIMC_ENOMEM;
 
-static size_t model_count_act(struct iimc_gpt2 *m)
-{
-	assert(m != NULL);
+	if (model_parse_header(m, map) != IIMC_ENONE ||
+			model_load_param_sizes(m) == 0) {
+		munmap(map, st.st_size);
+		return IIMC_EFILE_BAD_HEADER;
+	}
 
-	size_t count = 0;
-	int i;
-	for (i = 0; i < NUM_ACTIVATION_TENSORS; i++)
-		count += m->act_size[i];
+	size_t sizes[NUM_PARAMETER_TENSORS];
+	size_t bytes = m->param_count * (m->dtype == IIMC_DTYPE_BF16 ?
+			sizeof(unsigned short) : sizeof(float));
+	if (m->packed)
+		bytes = model_pack_sizes(m, sizes);
+	if (st.st_size < 256 * sizeof(int) + bytes) {
+		munmap(map, st.st_size);
+		return IIMC_EFILE_BAD_PARAMS;
+	}
 
-	return count;
-}
+	if (flags & IIMC_MMAP_WILLNEED)
+		madvise(map, st.st_size, MADV_WILLNEED);
 
-static void model_update_act_count(struct iimc_gpt2 *m)
-{
-	assert(m != NULL);
+	m->map = map;
+	m->map_bytes = st.st_size;
 
-	m->act_count = model_count_act(m);
-	m->act_bytes = m->act_count * sizeof(float);
-}
+	if (m->packed) {
+		model_set_params_packed(m, (char *) ((int *) map + 256));
+		return IIMC_ENONE;
+	}
 
+	if (m->dtype == IIMC_DTYPE_BF16)
+		return model_set_params_bf16(m,
+				(unsigned short *) ((int *) map + 256));
 
-static int model_init_acts(struct iimc_gpt2 *m, int b, int t)
+	m->params = (float *) ((int *) map + 256);
+	model_set_params(m);
+
+	return IIMC_ENONE;
+}
+
+static inline unsigned int random_u32(unsigned long long *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return (*state * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+static float random_f32(unsigned long long *state)
+{
+	return (random_u32(state) >> 8) / 16777216.0f;
+}
+
+/*
+ * Builds a model with the given shape and random weights instead of loading
+ * a checkpoint, e.g. to benchmark shapes without downloading them. The
+ * weights are uniform with the 0.02 standard deviation of the GPT-2
+ * initialization, the layernorms are the identity and the biases are zero.
+ */
+int iimc_gpt2_random(struct iimc_gpt2 *m, int max_seq_len, int vocab_size,
+		int num_layers, int num_heads, int channels,
+		unsigned long long seed)
+{
+	assert(m != NULL);
+	assert(m->params == NULL);
+
+	if (max_seq_len < 1 || vocab_size < 1 || num_layers < 1 ||
+			num_heads < 1 || channels % num_heads != 0)
+		return IIMC_EFILE_BAD_HEADER;
+
+	m->dtype = IIMC_DTYPE_F32;
+	m->cfg.max_seq_len = max_seq_len;
+	m->cfg.vocab_size = vocab_size;
+	m->cfg.num_layers = num_layers;
+	m->cfg.num_heads = num_heads;
+	m->cfg.channels = channels;
+
+	if (model_load_param_sizes(m) == 0)
+		return IIMC_EFILE_BAD_HEADER;
+
+	int r = model_load_params_new(m);
+	if (r != IIMC_ENONE)
+		return r;
+
+	/* 0 for weights, 1 for layernorm weights and 2 for biases */
+	static const char kind[NUM_PARAMETER_TENSORS] = {
+		0, 0, 1, 2, 0, 2, 0, 2, 1, 2, 0, 2, 0, 2, 1, 2
+	};
+	const float a = 0.02f * sqrtf(3.0f);
+	float *p = m->params;
+	if (seed == 0)
+		seed = 1;
+	int i;
+	for (i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+		size_t j;
+		for (j = 0; j < m->param_size[i]; j++) {
+			if (kind[i] == 0)
+				p[j] = (2.0f * random_f32(&seed) - 1.0f) * a;
+			else
+				p[j] = kind[i] == 1 ? 1.0f : 0.0f;
+		}
+		p += m->param_size[i];
+	}
+
+	return IIMC_ENONE;
+}
+
+/*
+ * Symmetric int8 quantization in groups of IIMC_Q8_GROUP consecutive values
+ * along c, each with its own scale: x ~ q * s with q in [-127, 127].
+ */
+static void quantize_q8(signed char *q, float *s, const float *x, size_t n)
+{
+	size_t g, k;
+	for (g = 0; g < n / IIMC_Q8_GROUP; g++) {
+		const float *xg = x + g * IIMC_Q8_GROUP;
+		signed char *qg = q + g * IIMC_Q8_GROUP;
+		float amax = 0.0f;
+		for (k = 0; k < IIMC_Q8_GROUP; k++)
+			if (fabsf(xg[k]) > amax)
+				amax = fabsf(xg[k]);
+
+		float scale = amax / 127.0f;
+		float inv = (scale != 0.0f) ? 1.0f / scale : 0.0f;
+		for (k = 0; k < IIMC_Q8_GROUP; k++)
+			qg[k] = (signed char) lrintf(xg[k] * inv);
+		s[g] = scale;
+	}
+}
+
+static void dequantize_q8(float *x, const signed char *q, const float *s,
+		size_t n)
+{
+	size_t k;
+	for (k = 0; k < n; k++)
+		x[k] = q[k] * s[k / IIMC_Q8_GROUP];
+}
+
+/*
+ * Replaces the fp32 parameter block by one that only holds the tensors that
+ * stay in fp32. The matmul weights must already live elsewhere.
+ */
+static int model_compact_params(struct iimc_gpt2 *m)
+{
+	assert(m != NULL);
+
+	size_t count = m->param_count - m->param_size[0] - m->param_size[4] -
+		m->param_size[6] - m->param_size[10] - m->param_size[12];
+
+	float *params;
+	int r = posix_memalign((void **) &params, 64, count * sizeof(float));
+	switch (r) {
+		case 0:
+			break;
+		case ENOMEM:
+			return IIMC_ENOMEM;
+		default:
+			return IIMC_EUNKNOWN;
+	}
+
+	float *p = params;
+	float **src[] = {
+		&m->param.wpe, &m->param.ln1w, &m->param.ln1b, &m->param.qkvb,
+		&m->param.attprojb, &m->param.ln2w, &m->param.ln2b,
+		&m->param.fcb, &m->param.fcprojb, &m->param.lnfw,
+		&m->param.lnfb
+	};
+	int ids[] = { 1, 2, 3, 5, 7, 8, 9, 11, 13, 14, 15 };
+	int i;
+	for (i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) {
+		memcpy(p, *src[i], m->param_size[ids[i]] * sizeof(float));
+		*src[i] = p;
+		p += m->param_size[ids[i]];
+	}
+
+	if (m->map != NULL)
+		munmap(m->map, m->map_bytes);
+	else
+		free(m->params);
+	m->map = NULL;
+	m->map_bytes = 0;
+
+	m->params = params;
+	m->param_count = count;
+	m->param_bytes = count * sizeof(float);
+	m->param.wte = NULL;
+	m->param.qkvw = NULL;
+	m->param.attprojw = NULL;
+	m->param.fcw = NULL;
+	m->param.fcprojw = NULL;
+
+	return IIMC_ENONE;
+}
+
+static int model_quantize_q8(struct iimc_gpt2 *m)
+{
+	assert(m != NULL);
+
+	if (m->cfg.channels % IIMC_Q8_GROUP != 0)
+		return IIMC_EBAD_DTYPE;
+
+	int ids[] = { 0, 4, 6, 10, 12 };
+	float *src[] = {
+		m->param.wte, m->param.qkvw, m->param.attprojw,
+		m->param.fcw, m->param.fcprojw
+	};
+	signed char **dst[] = {
+		&m->qparam.wte, &m->qparam.qkvw, &m->qparam.attprojw,
+		&m->qparam.fcw, &m->qparam.fcprojw
+	};
+	float **dst_s[] = {
+		&m->qparam.wte_s, &m->qparam.qkvw_s, &m->qparam.attprojw_s,
+		&m->qparam.fcw_s, &m->qparam.fcprojw_s
+	};
+
+	size_t count = 0;
+	int i;
+	for (i = 0; i < 5; i++)
+		count += m->param_size[ids[i]];
+
+	/* the int8 values of all tensors followed by all of their scales */
+	m->qparam_bytes = count + count / IIMC_Q8_GROUP * sizeof(float);
+	int r = posix_memalign(&m->qparams, 64, m->qparam_bytes);
+	switch (r) {
+		case 0:
+			break;
+		case ENOMEM:
+			m->qparams = NULL;
+			return IIMC_ENOMEM;
+		default:
+			m->qparams = NULL;
+			return IIMC_EUNKNOWN;
+	}
+
+	signed char *q = m->qparams;
+	float *qs = (float *) (q + count);
+	for (i = 0; i < 5; i++) {
+		size_t n = m->param_size[ids[i]];
+		quantize_q8(q, qs, src[i], n);
+		*dst[i] = q;
+		*dst_s[i] = qs;
+		q += n;
+		qs += n / IIMC_Q8_GROUP;
+	}
+
+	r = model_compact_params(m);
+	if (r != IIMC_ENONE) {
+		free(m->qparams);
+		m->qparams = NULL;
+		return r;
+	}
+
+	m->dtype = IIMC_DTYPE_Q8;
+	return IIMC_ENONE;
+}
+
+static int model_quantize_bf16(struct iimc_gpt2 *m)
+{
+	assert(m != NULL);
+
+	int ids[] = { 0, 4, 6, 10, 12 };
+	float *src[] = {
+		m->param.wte, m->param.qkvw, m->param.attprojw,
+		m->param.fcw, m->param.fcprojw
+	};
+	unsigned short **dst[] = {
+		&m->hparam.wte, &m->hparam.qkvw, &m->hparam.attprojw,
+		&m->hparam.fcw, &m->hparam.fcprojw
+	};
+
+	size_t count = 0;
+	int i;
+	for (i = 0; i < 5; i++)
+		count += m->param_size[ids[i]];
+
+	m->qparam_bytes = count * sizeof(unsigned short);
+	int r = posix_memalign(&m->qparams, 64, m->qparam_bytes);
+	switch (r) {
+		case 0:
+			break;
+		case ENOMEM:
+			m->qparams = NULL;
+			return IIMC_ENOMEM;
+		default:
+			m->qparams = NULL;
+			return IIMC_EUNKNOWN;
+	}
+
+	unsigned short *h = m->qparams;
+	for (i = 0; i < 5; i++) {
+		size_t k, n = m->param_size[ids[i]];
+		for (k = 0; k < n; k++)
+			h[k] = f32_to_bf16(src[i][k]);
+		*dst[i] = h;
+		h += n;
+	}
+
+	r = model_compact_params(m);
+	if (r != IIMC_ENONE) {
+		free(m->qparams);
+		m->qparams = NULL;
+		return r;
+	}
+
+	m->dtype = IIMC_DTYPE_BF16;
+	return IIMC_ENONE;
+}
+
+/*
+ * Converts the matmul weights of a loaded fp32 model (wte, qkvw, attprojw,
+ * fcw and fcprojw) to dtype. The remaining tensors stay in fp32.
+ */
+int iimc_gpt2_quantize(struct iimc_gpt2 *m, int dtype)
+{
+	assert(m != NULL);
+	assert(m->params != NULL);
+	assert(m->numa.mode == IIMC_NUMA_NONE);
+
+	if (m->dtype == dtype)
+		return IIMC_ENONE;
+
+	if (m->dtype != IIMC_DTYPE_F32 || m->packed)
+		return IIMC_EBAD_DTYPE;
+
+	switch (dtype) {
+		case IIMC_DTYPE_Q8:
+			return model_quantize_q8(m);
+		case IIMC_DTYPE_BF16:
+			return model_quantize_bf16(m);
+		default:
+			return IIMC_EBAD_DTYPE;
+	}
+}
+
+/* the rows of an [oc][c] weight in h byte values into panels */
+static void pack_panels(char *dst, const char *src, size_t oc, size_t c,
+		size_t h)
+{
+	size_t o, k;
+	for (o = 0; o < oc; o++) {
+		char *p = dst + (o / PACK_ROWS * PACK_ROWS * c +
+				o % PACK_ROWS * PACK_K) * h;
+		for (k = 0; k < c; k += PACK_K)
+			memcpy(p + k * PACK_ROWS * h, src + (o * c + k) * h,
+					PACK_K * h);
+	}
+}
+
+/*
+ * Rearranges the weights of a loaded fp32 or bf16 model into the packed
+ * layout described at PACK_VERSION. iimc_gpt2_save then writes a file that
+ * is used as it is mapped, so the work is done once and not at every load.
+ * A packed model cannot be quantized any more.
+ */
+int iimc_gpt2_pack(struct iimc_gpt2 *m)
+{
+	assert(m != NULL);
+	assert(m->params != NULL);
+	assert(m->numa.mode == IIMC_NUMA_NONE);
+
+	if (m->packed)
+		return IIMC_ENONE;
+
+	if (m->dtype == IIMC_DTYPE_Q8 || m->cfg.channels % PACK_K != 0)
+		return IIMC_EBAD_DTYPE;
+
+	size_t bytes[NUM_PARAMETER_TENSORS];
+	size_t n = model_pack_sizes(m, bytes);
+	char *base;
+	int r = posix_memalign((void **) &base, 64, n);
+	switch (r) {
+		case 0:
+			break;
+		case ENOMEM:
+			return IIMC_ENOMEM;
+		default:
+			return IIMC_EUNKNOWN;
+	}
+	memset(base, 0, n);
+
+	char *src[NUM_PARAMETER_TENSORS] = {
+		(char *) m->param.wte, (char *) m->param.wpe,
+		(char *) m->param.ln1w, (char *) m->param.ln1b,
+		(char *) m->param.qkvw, (char *) m->param.qkvb,
+		(char *) m->param.attprojw, (char *) m->param.attprojb,
+		(char *) m->param.ln2w, (char *) m->param.ln2b,
+		(char *) m->param.fcw, (char *) m->param.fcb,
+		(char *) m->param.fcprojw, (char *) m->param.fcprojb,
+		(char *) m->param.lnfw, (char *) m->param.lnfb
+	};
+	size_t h = sizeof(float);
+	if (m->dtype == IIMC_DTYPE_BF16) {
+		src[ 0] = (char *) m->hparam.wte;
+		src[ 4] = (char *) m->hparam.qkvw;
+		src[ 6] = (char *) m->hparam.attprojw;
+		src[10] = (char *) m->hparam.fcw;
+		src[12] = (char *) m->hparam.fcprojw;
+		h = sizeof(unsigned short);
+	}
+
+	/* output and input channels of the packed tensors, in c */
+	static const int oc[NUM_PARAMETER_TENSORS] = {
+		[4] = 3, [6] = 1, [10] = 4, [12] = 1
+	};
+	static const int ic[NUM_PARAMETER_TENSORS] = {
+		[4] = 1, [6] = 1, [10] = 1, [12] = 4
+	};
+	size_t c = m->cfg.channels;
+	char *p = base;
+	int i, l;
+	for (i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+		if (oc[i] == 0) {
+			memcpy(p, src[i], m->param_size[i] *
+					(i == 0 ? h : sizeof(float)));
+			p += bytes[i];
+			continue;
+		}
+		size_t o = oc[i] * c, k = ic[i] * c;
+		for (l = 0; l < m->cfg.num_layers; l++)
+			pack_panels(p + l * pack_rows(o) * k * h,
+					src[i] + l * o * k * h, o, k, h);
+		p += bytes[i];
+	}
+
+	if (m->params != NULL && !model_params_mapped(m))
+		free(m->params);
+	if (m->map != NULL)
+		munmap(m->map, m->map_bytes);
+	if (m->qparams != NULL)
+		free(m->qparams);
+	m->map = NULL;
+	m->map_bytes = 0;
+	m->qparams = NULL;
+	m->qparam_bytes = 0;
+
+	model_set_params_packed(m, base);
+	m->packed = 1;
+
+	return IIMC_ENONE;
+}
+
+/*
+ * NUMA placement of the weights. Every forward pass streams all weights, so
+ * on a machine with several nodes they should not all sit on the node of
+ * the thread that happened to read them in.
+ */
+#ifdef IIMC_NUMA
+struct weight_block {
+	char *base;
+	size_t bytes;
+	int mapped;	/* file pages, shared with other processes */
+	size_t off;	/* offset of the copy, or -1 if not copied */
+};
+
+/* the memory blocks all weight pointers of m point into */
+static int model_weight_blocks(struct iimc_gpt2 *m, struct weight_block *blk)
+{
+	int n = 0;
+
+	if (m->params != NULL) {
+		blk[n].base = (char *) m->params;
+		blk[n].bytes = m->param_bytes;
+		blk[n++].mapped = model_params_mapped(m);
+	}
+	if (m->qparams != NULL) {
+		blk[n].base = m->qparams;
+		blk[n].bytes = m->qparam_bytes;
+		blk[n++].mapped = 0;
+	}
+	/* bf16 matmul weights used in place from the file */
+	if (m->map != NULL && !model_params_mapped(m)) {
+		blk[n].base = m->map;
+		blk[n].bytes = m->map_bytes;
+		blk[n++].mapped = 1;
+	}
+
+	return n;
+}
+
+/* copies the blocks that have an offset to mem and points v at the copies */
+static void model_copy_weights(struct iimc_gpt2 *v, struct weight_block *blk,
+		int n, char *mem)
+{
+	void **ptrs[] = {
+		(void **) &v->param.wte, (void **) &v->param.wpe,
+		(void **) &v->param.ln1w, (void **) &v->param.ln1b,
+		(void **) &v->param.qkvw, (void **) &v->param.qkvb,
+		(void **) &v->param.attprojw, (void **) &v->param.attprojb,
+		(void **) &v->param.ln2w, (void **) &v->param.ln2b,
+		(void **) &v->param.fcw, (void **) &v->param.fcb,
+		(void **) &v->param.fcprojw, (void **) &v->param.fcprojb,
+		(void **) &v->param.lnfw, (void **) &v->param.lnfb,
+		(void **) &v->qparam.wte, (void **) &v->qparam.qkvw,
+		(void **) &v->qparam.attprojw, (void **) &v->qparam.fcw,
+		(void **) &v->qparam.fcprojw, (void **) &v->qparam.wte_s,
+		(void **) &v->qparam.qkvw_s, (void **) &v->qparam.attprojw_s,
+		(void **) &v->qparam.fcw_s, (void **) &v->qparam.fcprojw_s,
+		(void **) &v->hparam.wte, (void **) &v->hparam.qkvw,
+		(void **) &v->hparam.attprojw, (void **) &v->hparam.fcw,
+		(void **) &v->hparam.fcprojw
+	};
+	int i, j;
+
+	for (j = 0; j < n; j++)
+		if (blk[j].off != (size_t) -1)
+			memcpy(mem + blk[j].off, blk[j].base, blk[j].bytes);
+
+	for (i = 0; i < sizeof(ptrs) / sizeof(ptrs[0]); i++) {
+		char *p = *ptrs[i];
+		if (p == NULL)
+			continue;
+		for (j = 0; j < n; j++) {
+			if (blk[j].off == (size_t) -1 || p < blk[j].base ||
+					p >= blk[j].base + blk[j].bytes)
+				continue;
+			*ptrs[i] = mem + blk[j].off + (p - blk[j].base);
+			break;
+		}
+	}
+}
+
+/*
+ * Moves the whole pages of a private block to nodes. Placement is only a
+ * hint for speed, pages that cannot move simply stay where they are.
+ */
+static void model_move_block(struct weight_block *blk, int mode,
+		struct bitmask *nodes)
+{
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = ((uintptr_t) blk->base + page - 1) & ~(page - 1);
+	uintptr_t end = ((uintptr_t) blk->base + blk->bytes) & ~(page - 1);
+
+	if (end > start)
+		mbind((void *) start, end - start, mode, nodes->maskp,
+				nodes->size + 1, MPOL_MF_MOVE);
+}
+
+static int model_numa_interleave(struct iimc_gpt2 *m,
+		struct weight_block *blk, int n, size_t bytes)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		if (!blk[i].mapped)
+			model_move_block(&blk[i], MPOL_INTERLEAVE,
+					numa_all_nodes_ptr);
+
+	/* file pages belong to the page cache, m reads a private copy */
+	if (bytes > 0) {
+		m->numa.mem[0] = numa_alloc_interleaved(bytes);
+		if (m->numa.mem[0] == NULL)
+			return IIMC_ENOMEM;
+		model_copy_weights(m, blk, n, m->numa.mem[0]);
+	}
+
+	return IIMC_ENONE;
+}
+
+static int model_numa_replicate(struct iimc_gpt2 *m,
+		struct weight_block *blk, int n, size_t bytes)
+{
+	struct bitmask *allowed = numa_get_mems_allowed();
+	int first = -1;
+	int mapped = 0;
+	int i, node;
+
+	for (i = 0; i < n; i++)
+		mapped |= blk[i].mapped;
+
+	m->numa.view = calloc(m->numa.nodes, sizeof(struct iimc_gpt2 *));
+	if (m->numa.view == NULL) {
+		numa_bitmask_free(allowed);
+		return IIMC_ENOMEM;
+	}
+
+	for (node = 0; node < m->numa.nodes; node++) {
+		if (!numa_bitmask_isbitset(allowed, node))
+			continue;
+
+		/* the first node keeps the original if it can be moved */
+		if (first < 0 && !mapped) {
+			struct bitmask *mask = numa_allocate_nodemask();
+			numa_bitmask_setbit(mask, node);
+			for (i = 0; i < n; i++)
+				model_move_block(&blk[i], MPOL_BIND, mask);
+			numa_bitmask_free(mask);
+			m->numa.view[node] = m;
+			first = node;
+			continue;
+		}
+		if (first < 0)
+			first = node;
+
+		struct iimc_gpt2 *v = malloc(sizeof(struct iimc_gpt2));
+		m->numa.mem[node] = numa_alloc_onnode(bytes, node);
+		if (v == NULL || m->numa.mem[node] == NULL) {
+			free(v);
+			numa_bitmask_free(allowed);
+			return IIMC_ENOMEM;
+		}
+		memcpy(v, m, sizeof(struct iimc_gpt2));
+		model_copy_weights(v, blk, n, m->numa.mem[node]);
+		m->numa.view[node] = v;
+	}
+
+	numa_bitmask_free(allowed);
+	return IIMC_ENONE;
+}
+#endif
+
+static void model_numa_free(struct iimc_gpt2 *m)
+{
+#ifdef IIMC_NUMA
+	int i;
+	for (i = 0; i < m->numa.nodes; i++) {
+		if (m->numa.view != NULL && m->numa.view[i] != m)
+			free(m->numa.view[i]);
+		if (m->numa.mem != NULL && m->numa.mem[i] != NULL)
+			numa_free(m->numa.mem[i], m->numa.bytes);
+	}
+	free(m->numa.view);
+	free(m->numa.mem);
+#endif
+	memset(&m->numa, 0, sizeof(m->numa));
+}
+
+/* the mode named by the -N option of the tools, or -1 for unknown names */
+int iimc_numa_parse(const char *name)
+{
+	assert(name != NULL);
+
+	if (strcmp(name, "interleave") == 0)
+		return IIMC_NUMA_INTERLEAVE;
+	if (strcmp(name, "replicate") == 0)
+		return IIMC_NUMA_REPLICATE;
+	return -1;
+}
+
+/*
+ * Places the weights of a loaded, possibly quantized model on the NUMA
+ * nodes. IIMC_NUMA_INTERLEAVE spreads their pages over all nodes so that
+ * every thread sees the bandwidth of all of them. IIMC_NUMA_REPLICATE
+ * keeps a full copy on every node and each thread of the pool reads the
+ * copy of the node it runs on, so the threads should be pinned with
+ * iimc_pool_new. Weights in a file mapping are copied, since the page
+ * cache cannot be moved.
+ */
+int iimc_gpt2_numa(struct iimc_gpt2 *m, int mode)
+{
+	assert(m != NULL);
+	assert(m->params != NULL);
+	assert(m->numa.mode == IIMC_NUMA_NONE);
+
+	if (mode == IIMC_NUMA_NONE)
+		return IIMC_ENONE;
+	if (mode != IIMC_NUMA_INTERLEAVE && mode != IIMC_NUMA_REPLICATE)
+		return IIMC_EUNKNOWN;
+
+#ifdef IIMC_NUMA
+	if (numa_available() < 0)
+		return IIMC_ENO_NUMA;
+
+	struct weight_block blk[3];
+	int n = model_weight_blocks(m, blk);
+	size_t bytes = 0;
+	int i;
+	for (i = 0; i < n; i++) {
+		blk[i].off = (size_t) -1;
+		if (mode == IIMC_NUMA_REPLICATE || blk[i].mapped) {
+			blk[i].off = bytes;
+			bytes += (blk[i].bytes + 63) & ~(size_t) 63;
+		}
+	}
+
+	m->numa.mode = mode;
+	m->numa.nodes = numa_max_node() + 1;
+	m->numa.bytes = bytes;
+	m->numa.mem = calloc(m->numa.nodes, sizeof(void *));
+	if (m->numa.mem == NULL) {
+		model_numa_free(m);
+		return IIMC_ENOMEM;
+	}
+
+	int r;
+	if (mode == IIMC_NUMA_INTERLEAVE)
+		r = model_numa_interleave(m, blk, n, bytes);
+	else
+		r = model_numa_replicate(m, blk, n, bytes);
+	if (r != IIMC_ENONE)
+		model_numa_free(m);
+	return r;
+#else
+	return IIMC_ENO_NUMA;
+#endif
+}
+
+/* the copy of the weights closest to the calling thread */
+static struct iimc_gpt2 *model_local_weights(struct iimc_gpt2 *m)
+{
+#ifdef IIMC_NUMA
+	if (m->numa.view != NULL) {
+		int cpu = sched_getcpu();
+		int node = cpu < 0 ? -1 : numa_node_of_cpu(cpu);
+		if (node >= 0 && node < m->numa.nodes &&
+				m->numa.view[node] != NULL)
+			return m->numa.view[node];
+	}
+#endif
+	return m;
+}
+
+static int model_save_bf16(struct iimc_gpt2 *m, FILE *mf)
+{
+	float *ptrs[NUM_PARAMETER_TENSORS] = {
+		m->param.wte, m->param.wpe, m->param.ln1w, m->param.ln1b,
+		m->param.qkvw, m->param.qkvb, m->param.attprojw,
+		m->param.attprojb, m->param.ln2w, m->param.ln2b,
+		m->param.fcw, m->param.fcb, m->param.fcprojw,
+		m->param.fcprojb, m->param.lnfw, m->param.lnfb
+	};
+	unsigned short *hptrs[NUM_PARAMETER_TENSORS] = {
+		[ 0] = m->hparam.wte,
+		[ 4] = m->hparam.qkvw,
+		[ 6] = m->hparam.attprojw,
+		[10] = m->hparam.fcw,
+		[12] = m->hparam.fcprojw
+	};
+
+	unsigned short buf[4096];
+	int i;
+	for (i = 0; i < NUM_PARAMETER_TENSORS; i++) {
+		size_t n = m->param_size[i];
+		if (hptrs[i] != NULL) {
+			if (fwrite(hptrs[i], n * sizeof(unsigned short),
+						1, mf) != 1)
+				return IIMC_EFILE_BAD_PARAMS;
+			continue;
+		}
+
+		size_t j, k;
+		for (j = 0; j < n; j += k) {
+			for (k = 0; k < 4096 && j + k < n; k++)
+				buf[k] = f32_to_bf16(ptrs[i][j + k]);
+			if (fwrite(buf, k * sizeof(unsigned short), 1, mf) != 1)
+				return IIMC_EFILE_BAD_PARAMS;
+		}
+	}
+
+	return IIMC_ENONE;
+}
+
+/*
+ * Writes the model as an llm.c checkpoint: version 1 for fp32 and
+ * version 3 for bf16, or version 4 once packed. int8 models have no file
+ * format.
+ */
+int iimc_gpt2_save(struct iimc_gpt2 *m, const char *path)
+{
+	assert(m != NULL);
+	assert(path != NULL);
+
+	if (m->dtype == IIMC_DTYPE_Q8)
+		return IIMC_EBAD_DTYPE;
+
+	FILE *mf = fopen(path, "wb");
+	if (mf == NULL)
+		return IIMC_EFILE_NOT_FOUND;
+
+	int header[256];
+	memset(header, 0, sizeof(header));
+	header[0] = 20240326;
+	header[1] = (m->dtype == IIMC_DTYPE_BF16) ? 3 : 1;
+	header[2] = m->cfg.max_seq_len;
+	header[3] = m->cfg.vocab_size;
+	header[4] = m->cfg.num_layers;
+	header[5] = m->cfg.num_heads;
+	header[6] = m->cfg.channels;
+	if (m->packed) {
+		header[1] = 4;
+		header[7] = m->dtype;
+		header[8] = PACK_VERSION;
+		header[9] = PACK_ROWS;
+		header[10] = PACK_K;
+	}
+
+	int r = IIMC_ENONE;
+	if (fwrite(header, sizeof(header), 1, mf) != 1)
+		r = IIMC_EFILE_BAD_HEADER;
+	else if (m->packed)
+		r = fwrite(m->params, m->param_bytes, 1, mf) == 1 ?
+			IIMC_ENONE : IIMC_EFILE_BAD_PARAMS;
+	else if (m->dtype == IIMC_DTYPE_BF16)
+		r = model_save_bf16(m, mf);
+	else if (fwrite(m->params, m->param_bytes, 1, mf) != 1)
+		r = IIMC_EFILE_BAD_PARAMS;
+
+	if (fclose(mf) != 0 && r == IIMC_ENONE)
+		r = IIMC_EFILE_BAD_PARAMS;
+
+	return r;
+}
+
+static int model_init_acts_new(struct iimc_gpt2 *m)
+{
+	assert(m != NULL);
+
+	if (m->acts != NULL)
+		free(m->acts);
+
+	int r = posix_memalign((void **) &m->acts, 64, m->act_bytes);
+	switch (r) {
+		case 0:
+			break;
+		case ENOMEM:
+			return IIMC_ENOMEM;
+		default:
+			return IIMC_EUNKNOWN;
+	}
+
+	float *p = m->acts;
+	m->act.encoded = p;
+	p += m->act_size[ 0]; m->act.ln1 = p;
+	p += m->act_size[ 1]; m->act.ln1_mean = p;
+	p += m->act_size[ 2]; m->act.ln1_rstd = p;
+	p += m->act_size[ 3]; m->act.qkv = p;
+	p += m->act_size[ 4]; m->act.atty = p;
+	p += m->act_size[ 5]; m->act.ln2 = p;
+	p += m->act_size[ 6]; m->act.ln2_mean = p;
+	p += m->act_size[ 7]; m->act.ln2_rstd = p;
+	p += m->act_size[ 8]; m->act.fch = p;
+	p += m->act_size[ 9]; m->act.lnf = p;
+	p += m->act_size[10]; m->act.lnf_mean = p;
+	p += m->act_size[11]; m->act.lnf_rstd = p;
+	p += m->act_size[12]; m->act.logits = p;
+	p += m->act_size[13]; m->act.probs = p;
+	p += m->act_size[14]; m->act.losses = p;
+	p += m->act_size[15]; m->act.q8x = p;
+	p += m->act_size[16]; m->act.q8s = p;
+
+	return IIMC_ENONE;
+}
+
+static size_t model_count_act(struct iimc_gpt2 *m)
+{
+	assert(m != NULL);
+
+	size_t count = 0;
+	int i;
+	for (i = 0; i < NUM_ACTIVATION_TENSORS; i++)
+		count += m->act_size[i];
+
+	return count;
+}
+
+static void model_update_act_count(struct iimc_gpt2 *m)
+{
+	assert(m != NULL);
+
+	m->act_count = model_count_act(m);
+	m->act_bytes = m->act_count * sizeof(float);
+}
+
+/*
+ * With IIMC_OUTPUT_LOSSES the lm head runs over this many positions at a
+ * time, which bounds the logits buffer at LOSS_ROWS rows while every
+ * chunk still reads the embedding matrix only once.
+ */
+#define LOSS_ROWS	256
+
+/* rows of logits per batch row after a forward pass over t positions */
+static int model_output_rows(struct iimc_gpt2 *m, int t)
+{
+	if (!(m->output & IIMC_OUTPUT_LAST))
+		return t;
+
+	int n = m->output_last > 1 ? m->output_last : 1;
+	return t < n ? t : n;
+}
+
+static int model_init_acts(struct iimc_gpt2 *m, int b, int t)
+{
+	/*
+	 * Inference only needs the activations of the layer being computed:
+	 * one set of per-layer buffers is shared by all layers, which keeps
+	 * act_bytes independent of the number of layers. The matmul
+	 * epilogues add the attention and mlp outputs to the residual stream
+	 * in encoded and apply gelu to fch in place.
+	 */
+	size_t bt = b * t;
+	int v = m->cfg.vocab_size;
+	int c = m->cfg.channels;
+	m->act_size[ 0] = bt * c;
+	m->act_size[ 1] = bt * c;
+	m->act_size[ 2] = bt;
+	m->act_size[ 3] = bt;
+	m->act_size[ 4] = bt * c * 3;
+	m->act_size[ 5] = bt * c;
+	m->act_size[ 6] = bt * c;
+	m->act_size[ 7] = bt;
+	m->act_size[ 8] = bt;
+	m->act_size[ 9] = bt * c * 4;
+	m->act_size[10] = bt * c;
+	m->act_size[11] = bt;
+	m->act_size[12] = bt;
+	m->act_size[13] = (size_t) b * model_output_rows(m, t) * v;
+	m->act_size[14] = (m->output & IIMC_OUTPUT_LOGITS) ? 0 :
+		m->act_size[13];
+	if (m->output & IIMC_OUTPUT_LOSSES) {
+		m->act_size[13] = (size_t) (bt < LOSS_ROWS ? bt : LOSS_ROWS) * v;
+		m->act_size[14] = 0;
+	}
+	m->act_size[15] = bt;
+	/* int8 copy of the widest matmul input (4 * c bytes) and its scales */
+	m->act_size[16] = bt * c;
+	m->act_size[17] = bt * 4 * c / IIMC_Q8_GROUP;
+
+	model_update_act_count(m);
+
+	return IIMC_ENONE;
+}
+
+static int model_init_kv(struct iimc_gpt2 *m, int b, int t)
+{
+	assert(m != NULL);
+
+	if (m->kv.k != NULL)
+		free(m->kv.k);
+	if (m->kv.len != NULL)
+		free(m->kv.len);
+	m->kv.k = NULL;
+	m->kv.v = NULL;
+
+	m->kv.b = b;
+	m->kv.t = t;
+
+	/* one [l][b][t][c] block for the keys followed by one for the values */
+	size_t n = (size_t) m->cfg.num_layers * b * t * m->cfg.channels;
+	m->kv.bytes = 2 * n * sizeof(float);
+
+	/* len, pos and slot share one allocation, see model_forward */
+	m->kv.len = calloc(3 * b, sizeof(int));
+	if (m->kv.len == NULL)
+		return IIMC_ENOMEM;
+	m->kv.pos = m->kv.len + b;
+	m->kv.slot = m->kv.pos + b;
+
+	int i;
+	for (i = 0; i < b; i++)
+		m->kv.slot[i] = i;
+
+	int r = posix_memalign((void **) &m->kv.k, 64, m->kv.bytes);
+	switch (r) {
+		case 0:
+			break;
+		case ENOMEM:
+			m->kv.k = NULL;
+			return IIMC_ENOMEM;
+		default:
+			m->kv.k = NULL;
+			return IIMC_EUNKNOWN;
+	}
+	m->kv.v = m->kv.k + n;
+
+	return IIMC_ENONE;
+}
+
+int iimc_gpt2_init(struct iimc_gpt2 *m, int b, int t)
+{
+	assert(m != NULL);
+	int r;
+
+	r = model_init_acts(m, b, t);
+	if (r != IIMC_ENONE)
+		return r;
+
+	r = model_init_acts_new(m);
+	if (r != IIMC_ENONE)
+		return r;
+
+	/* scoring runs whole sequences through iimc_gpt2_forward only */
+	if (m->output & IIMC_OUTPUT_LOSSES)
+		return IIMC_ENONE;
+
+	r = model_init_kv(m, b, t);
+	if (r != IIMC_ENONE)
+		return r;
+
+	return IIMC_ENONE;
+}
+
+/*
+ * The kernels below run on every thread of the pool at once. Thread ith of
+ * nth takes the share of the work that split_work gives it.
+ */
+static inline void split_work(int n, int ith, int nth, int *i0, int *i1)
+{
+	*i0 = (int) ((long long) n * ith / nth);
+	*i1 = (int) ((long long) n * (ith + 1) / nth);
+}
+
+static void encoder_forward(float *out, int *in, float *wte, float *wpe,
+		int *pos, int b, int t, int c, int ith, int nth)
+{
+	int r, r0, r1, k;
+
+	split_work(b * t, ith, nth, &r0, &r1);
+	for (r = r0; r < r1; r++) {
+		int i = r / t, j = r % t;
+		float *o = out + (size_t) r * c;
+		float *wte_ix = wte + (size_t) in[r] * c;
+		int p = (pos == NULL) ? j : pos[i] + j;
+		float *wpe_t = wpe + p * c;
+		for (k = 0; k < c; k++) {
+			o[k] = wte_ix[k] + wpe_t[k];
+		}
+	}
+}
+
+static void encoder_forward_q8(float *out, int *in, signed char *wte,
+		float *wte_s, float *wpe, int *pos, int b, int t, int c,
+		int ith, int nth)
+{
+	int r, r0, r1, k;
+
+	split_work(b * t, ith, nth, &r0, &r1);
+	for (r = r0; r < r1; r++) {
+		int i = r / t, j = r % t;
+		float *o = out + (size_t) r * c;
+		size_t ix = in[r];
+		int p = (pos == NULL) ? j : pos[i] + j;
+		float *wpe_t = wpe + p * c;
+		dequantize_q8(o, wte + ix * c,
+				wte_s + ix * c / IIMC_Q8_GROUP, c);
+		for (k = 0; k < c; k++) {
+			o[k] += wpe_t[k];
+		}
+	}
+}
+
+static void encoder_forward_bf16(float *out, int *in, unsigned short *wte,
+		float *wpe, int *pos, int b, int t, int c, int ith, int nth)
+{
+	int r, r0, r1, k;
+
+	split_work(b * t, ith, nth, &r0, &r1);
+	for (r = r0; r < r1; r++) {
+		int i = r / t, j = r % t;
+		float *o = out + (size_t) r * c;
+		unsigned short *wte_ix = wte + (size_t) in[r] * c;
+		int p = (pos == NULL) ? j : pos[i] + j;
+		float *wpe_t = wpe + p * c;
+		for (k = 0; k < c; k++) {
+			o[k] = bf16_to_f32(wte_ix[k]) + wpe_t[k];
+		}
+	}
+}
+
+static inline void layernorm_stats(const float *x, int c, float *mean,
+		float *rstd)
+{
+	float eps = 1e-5f;
+	int k;
+
+	float m = 0.0f;
+	for (k = 0; k < c; k++) {
+		m += x[k];
+	}
+	m = m / c;
+
+	float v = 0.0f;
+	for (k = 0; k < c; k++) {
+		float xshift = x[k] - m;
+		v += xshift * xshift;
+	}
+	v = v / c;
+
+	*mean = m;
+	*rstd = 1.0f / sqrtf(v + eps);
+}
+
+static void layernorm_forward(float *out, float *mean, float *rstd, float *inp,
+		float *weight, float *bias, int b, int t, int c, int ith,
+		int nth)
+{
+	int r, r0, r1, k;
+
+	split_work(b * t, ith, nth, &r0, &r1);
+	for (r = r0; r < r1; r++) {
+		float *x = inp + (size_t) r * c;
+		float m, s;
+		layernorm_stats(x, c, &m, &s);
+
+		float *o = out + (size_t) r * c;
+		for (k = 0; k < c; k++) {
+			float n = s * (x[k] - m);
+			o[k] = n * weight[k] + bias[k];
+		}
+		mean[r] = m;
+		rstd[r] = s;
+	}
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+static inline float hsum256(__m256 v)
+{
+	__m128 lo = _mm256_castps256_ps128(v);
+	__m128 hi = _mm256_extractf128_ps(v, 1);
+	lo = _mm_add_ps(lo, hi);
+	lo = _mm_hadd_ps(lo, lo);
+	lo = _mm_hadd_ps(lo, lo);
+	return _mm_cvtss_f32(lo);
+}
+#endif
+
+static inline float dot_f32(const float *a, const float *b, int n)
+{
+	float val = 0.0f;
+	int k = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+	__m256 acc0 = _mm256_setzero_ps();
+	__m256 acc1 = _mm256_setzero_ps();
+	for (; k + 16 <= n; k += 16) {
+		acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + k),
+				_mm256_loadu_ps(b + k), acc0);
+		acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + k + 8),
+				_mm256_loadu_ps(b + k + 8), acc1);
+	}
+	val = hsum256(_mm256_add_ps(acc0, acc1));
+#endif
+	for (; k < n; k++)
+		val += a[k] * b[k];
+	return val;
+}
+
+/*
+ * exp for the softmax, attention and gelu kernels. The argument is split
+ * into n * ln2 + r with |r| <= ln2 / 2 and e^r comes from the degree 6
+ * polynomial of Cephes expf. Against exp in double precision the relative
+ * error stays below 1e-7, about 1.5 ulp, on [-87.3, 88.3]; smaller
+ * arguments, -inf included, give 0 and larger ones are clamped to e^88.3.
+ * The scalar and AVX2 versions do the same operations in the same order,
+ * so a result does not depend on whether it fell in the vector body or in
+ * the tail.
+ */
+#define EXP_HI 88.37625f
+#define EXP_LO -87.3365478515625f
+
+static inline float exp_f32(float x)
+{
+	union { float f; int i; } pow2n;
+
+	if (x < EXP_LO)
+		return 0.0f;
+	if (x > EXP_HI)
+		x = EXP_HI;
+
+	float n = rintf(x * 1.44269504088896341f);
+	float r = fmaf(n, -0.693359375f, x);
+	r = fmaf(n, 2.12194440e-4f, r);
+
+	float y = 1.9875691500e-4f;
+	y = fmaf(y, r, 1.3981999507e-3f);
+	y = fmaf(y, r, 8.3334519073e-3f);
+	y = fmaf(y, r, 4.1665795894e-2f);
+	y = fmaf(y, r, 1.6666665459e-1f);
+	y = fmaf(y, r, 5.0000001201e-1f);
+	y = fmaf(y, r * r, r);
+	y = y + 1.0f;
+
+	pow2n.i = ((int) n + 127) << 23;
+	return y * pow2n.f;
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+static inline __m256 exp256(__m256 x)
+{
+	__m256 zero = _mm256_cmp_ps(x, _mm256_set1_ps(EXP_LO), _CMP_LT_OQ);
+	x = _mm256_min_ps(x, _mm256_set1_ps(EXP_HI));
+	x = _mm256_max_ps(x, _mm256_set1_ps(EXP_LO));
+
+	__m256 n = _mm256_round_ps(_mm256_mul_ps(x,
+				_mm256_set1_ps(1.44269504088896341f)),
+			_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	__m256 r = _mm256_fmadd_ps(n, _mm256_set1_ps(-0.693359375f), x);
+	r = _mm256_fmadd_ps(n, _mm256_set1_ps(2.12194440e-4f), r);
+
+	__m256 y = _mm256_set1_ps(1.9875691500e-4f);
+	y = _mm256_fmadd_ps(y, r, _mm256_set1_ps(1.3981999507e-3f));
+	y = _mm256_fmadd_ps(y, r, _mm256_set1_ps(8.3334519073e-3f));
+	y = _mm256_fmadd_ps(y, r, _mm256_set1_ps(4.1665795894e-2f));
+	y = _mm256_fmadd_ps(y, r, _mm256_set1_ps(1.6666665459e-1f));
+	y = _mm256_fmadd_ps(y, r, _mm256_set1_ps(5.0000001201e-1f));
+	y = _mm256_fmadd_ps(y, _mm256_mul_ps(r, r), r);
+	y = _mm256_add_ps(y, _mm256_set1_ps(1.0f));
+
+	__m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n),
+				_mm256_set1_epi32(127)), 23);
+	y = _mm256_mul_ps(y, _mm256_castsi256_ps(e));
+	return _mm256_andnot_ps(zero, y);
+}
+
+static inline float hmax256(__m256 v)
+{
+	__m128 lo = _mm256_castps256_ps128(v);
+	__m128 hi = _mm256_extractf128_ps(v, 1);
+	lo = _mm_max_ps(lo, hi);
+	lo = _mm_max_ps(lo, _mm_movehl_ps(lo, lo));
+	lo = _mm_max_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+	return _mm_cvtss_f32(lo);
+}
+#endif
+
+/* out[i] = exp(x[i] - max), returns the sum of out */
+static float exp_sub_sum(float *out, const float *x, float max, int n)
+{
+	float sum = 0.0f;
+	int k = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+	__m256 vmax = _mm256_set1_ps(max);
+	__m256 acc = _mm256_setzero_ps();
+	for (; k + 8 <= n; k += 8) {
+		__m256 e = exp256(_mm256_sub_ps(_mm256_loadu_ps(x + k), vmax));
+		_mm256_storeu_ps(out + k, e);
+		acc = _mm256_add_ps(acc, e);
+	}
+	sum = hsum256(acc);
+#endif
+	for (; k < n; k++) {
+		out[k] = exp_f32(x[k] - max);
+		sum += out[k];
+	}
+	return sum;
+}
+
+/* the sum of exp(x[i] - max) */
+static float exp_sub_total(const float *x, float max, int n)
+{
+	float sum = 0.0f;
+	int k = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+	__m256 vmax = _mm256_set1_ps(max);
+	__m256 acc = _mm256_setzero_ps();
+	for (; k + 8 <= n; k += 8)
+		acc = _mm256_add_ps(acc, exp256(_mm256_sub_ps(
+						_mm256_loadu_ps(x + k), vmax)));
+	sum = hsum256(acc);
+#endif
+	for (; k < n; k++)
+		sum += exp_f32(x[k] - max);
+	return sum;
+}
+
+static float max_f32(const float *x, int n, float max)
+{
+	int k = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+	if (n >= 8) {
+		__m256 vmax = _mm256_set1_ps(max);
+		for (; k + 8 <= n; k += 8)
+			vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(x + k));
+		max = hmax256(vmax);
+	}
+#endif
+	for (; k < n; k++)
+		if (x[k] > max)
+			max = x[k];
+	return max;
+}
+
+/*
+ * The tanh approximation of gelu, 0.5 * x * (1 + tanh(u)), in place. It is
+ * rewritten with 1 + tanh(u) = 2 / (1 + exp(-2u)) so that it needs one exp
+ * and no tanh, and is within 6e-7 of the exact formula for |x| < 10.
+ */
+static void gelu_f32(float *x, int n)
+{
+	const float s = -2.0f * sqrtf(2.0f / M_PI);
+	int i = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+	__m256 vs = _mm256_set1_ps(s);
+	__m256 vc = _mm256_set1_ps(0.044715f);
+	__m256 one = _mm256_set1_ps(1.0f);
+	for (; i + 8 <= n; i += 8) {
+		__m256 v = _mm256_loadu_ps(x + i);
+		__m256 u = _mm256_fmadd_ps(_mm256_mul_ps(vc, v),
+				_mm256_mul_ps(v, v), v);
+		__m256 e = exp256(_mm256_mul_ps(vs, u));
+		_mm256_storeu_ps(x + i,
+				_mm256_div_ps(v, _mm256_add_ps(one, e)));
+	}
+#endif
+	for (; i < n; i++) {
+		float v = x[i];
+		float u = fmaf(0.044715f * v, v * v, v);
+		x[i] = v / (1.0f + exp_f32(s * u));
+	}
+}
+
+/*
+ * The matmuls compute out[bt][oc] = inp[bt][c] * weight[oc][c]^T + bias[oc].
+ *
+ * The work is split in blocks of MATMUL_BLOCK_BT rows by MATMUL_BLOCK_OC
+ * output channels, so that a block of weights stays in L2 while every row of
+ * the block streams past it, and so that b * t == 1 still spreads over all
+ * cores. Inside a block a 4x3 register tile shares each weight load between
+ * four rows and each input load between three output channels.
+ */
+#define MATMUL_BLOCK_BT	64
+#define MATMUL_BLOCK_OC	48
+#define MATMUL_GEMV_OC	64
+
+/*
+ * The matmul entry points are kept out of line: inlined into the large
+ * forward worker, gcc runs out of registers in their inner loops.
+ */
+#define MATMUL_NOINLINE __attribute__((noinline))
+
+/*
+ * What a matmul does with its results besides adding the bias. MATMUL_ADD
+ * adds them to out, which holds the residual stream, and MATMUL_GELU
+ * applies gelu to each block of out right after it is computed, while it
+ * is still in cache. Either saves a pass over an activation tensor and the
+ * buffer it was written to.
+ */
+enum matmul_epilogue {
+	MATMUL_STORE = 0,
+	MATMUL_ADD,
+	MATMUL_GELU
+};
+
+static inline void matmul_store(float *out, float v, const float *bias,
+		int o, int epi)
+{
+	if (bias != NULL)
+		v += bias[o];
+	*out = (epi == MATMUL_ADD) ? *out + v : v;
+}
+
+/* gelu of the rows [r0, r1) and output channels [o0, o1) of out */
+static void matmul_gelu(float *out, int r0, int r1, int o0, int o1, int oc)
+{
+	int r;
+	for (r = r0; r < r1; r++)
+		gelu_f32(out + (size_t) r * oc + o0, o1 - o0);
+}
+
+static void matmul_tile_4x3(float *out, const float *inp, const float *weight,
+		const float *bias, int c, int oc, int epi)
+{
+	int r, o, k = 0;
+	float val[4][3] = {{ 0.0f }};
+
+#if defined(__AVX2__) && defined(__FMA__)
+	__m256 acc[4][3];
+	for (r = 0; r < 4; r++)
+		for (o = 0; o < 3; o++)
+			acc[r][o] = _mm256_setzero_ps();
+
+	for (; k + 8 <= c; k += 8) {
+		__m256 w0 = _mm256_loadu_ps(weight + k);
+		__m256 w1 = _mm256_loadu_ps(weight + c + k);
+		__m256 w2 = _mm256_loadu_ps(weight + 2 * c + k);
+		for (r = 0; r < 4; r++) {
+			__m256 x = _mm256_loadu_ps(inp + r * c + k);
+			acc[r][0] = _mm256_fmadd_ps(x, w0, acc[r][0]);
+			acc[r][1] = _mm256_fmadd_ps(x, w1, acc[r][1]);
+			acc[r][2] = _mm256_fmadd_ps(x, w2, acc[r][2]);
+		}
+	}
+
+	for (r = 0; r < 4; r++)
+		for (o = 0; o < 3; o++)
+			val[r][o] = hsum256(acc[r][o]);
+#endif
+
+	for (r = 0; r < 4; r++) {
+		for (o = 0; o < 3; o++) {
+			const float *x = inp + r * c;
+			const float *w = weight + o * c;
+			float v = val[r][o];
+			int m;
+			for (m = k; m < c; m++)
+				v += x[m] * w[m];
+			matmul_store(out + r * oc + o, v, bias, o, epi);
+		}
+	}
+}
+
+static void matmul_edge(float *out, const float *inp, const float *weight,
+		const float *bias, int nr, int no, int c, int oc, int epi)
+{
+	int r, o;
+	for (r = 0; r < nr; r++) {
+		for (o = 0; o < no; o++) {
+			float v = dot_f32(inp + r * c, weight + o * c, c);
+			matmul_store(out + r * oc + o, v, bias, o, epi);
+		}
+	}
+}
+
+/*
+ * matmul_tile_4x3 on a packed weight panel, the no <= PACK_ROWS outputs
+ * that are not padding are stored. c is a multiple of PACK_K.
+ */
+static void matmul_tile_4x3_packed(float *out, const float *inp,
+		const float *panel, const float *bias, int no, int c, int oc,
+		int epi)
+{
+	int r, o, k;
+	float val[4][PACK_ROWS] = {{ 0.0f }};
+
+#if defined(__AVX2__) && defined(__FMA__)
+	__m256 acc[4][3];
+	for (r = 0; r < 4; r++)
+		for (o = 0; o < 3; o++)
+			acc[r][o] = _mm256_setzero_ps();
+
+	for (k = 0; k < c; k += PACK_K) {
+		const float *w = panel + k * PACK_ROWS;
+		__m256 w0 = _mm256_loadu_ps(w);
+		__m256 w1 = _mm256_loadu_ps(w + 8);
+		__m256 w2 = _mm256_loadu_ps(w + 16);
+		for (r = 0; r < 4; r++) {
+			__m256 x = _mm256_loadu_ps(inp + r * c + k);
+			acc[r][0] = _mm256_fmadd_ps(x, w0, acc[r][0]);
+			acc[r][1] = _mm256_fmadd_ps(x, w1, acc[r][1]);
+			acc[r][2] = _mm256_fmadd_ps(x, w2, acc[r][2]);
+		}
+	}
+
+	for (r = 0; r < 4; r++)
+		for (o = 0; o < 3; o++)
+			val[r][o] = hsum256(acc[r][o]);
+#else
+	for (r = 0; r < 4; r++)
+		for (o = 0; o < PACK_ROWS; o++)
+			for (k = 0; k < c; k++)
+				val[r][o] += inp[r * c + k] *
+					panel[pack_at(o, k)];
+#endif
+
+	for (r = 0; r < 4; r++)
+		for (o = 0; o < no; o++)
+			matmul_store(out + r * oc + o, val[r][o], bias, o, epi);
+}
+
+/* the nr < 4 rows left over by matmul_tile_4x3_packed, one at a time */
+static void matmul_panel(float *out, const float *inp, const float *panel,
+		const float *bias, int nr, int no, int c, int oc, int epi)
+{
+	int r, o, k;
+	for (r = 0; r < nr; r++) {
+		const float *x = inp + (size_t) r * c;
+		float val[PACK_ROWS] = { 0.0f };
+#if defined(__AVX2__) && defined(__FMA__)
+		__m256 acc0 = _mm256_setzero_ps();
+		__m256 acc1 = _mm256_setzero_ps();
+		__m256 acc2 = _mm256_setzero_ps();
+		for (k = 0; k < c; k += PACK_K) {
+			const float *w = panel + k * PACK_ROWS;
+			__m256 xk = _mm256_loadu_ps(x + k);
+			acc0 = _mm256_fmadd_ps(xk, _mm256_loadu_ps(w), acc0);
+			acc1 = _mm256_fmadd_ps(xk,
+					_mm256_loadu_ps(w + 8), acc1);
+			acc2 = _mm256_fmadd_ps(xk,
+					_mm256_loadu_ps(w + 16), acc2);
+		}
+		val[0] = hsum256(acc0);
+		val[1] = hsum256(acc1);
+		val[2] = hsum256(acc2);
+#else
+		for (o = 0; o < PACK_ROWS; o++)
+			for (k = 0; k < c; k++)
+				val[o] += x[k] * panel[pack_at(o, k)];
+#endif
+		for (o = 0; o < no; o++)
+			matmul_store(out + (size_t) r * oc + o, val[o], bias,
+					o, epi);
+	}
+}
+
+/*
+ * The rows [0, nr) against the output channels [0, no) of weight, at most
+ * 4 by 3, for a packed weight a panel.
+ */
+static inline void matmul_tile(float *out, const float *inp,
+		const float *weight, const float *bias, int nr, int no, int c,
+		int oc, int epi, int packed)
+{
+	if (packed && nr == 4)
+		matmul_tile_4x3_packed(out, inp, weight, bias, no, c, oc, epi);
+	else if (packed)
+		matmul_panel(out, inp, weight, bias, nr, no, c, oc, epi);
+	else if (nr == 4 && no == 3)
+		matmul_tile_4x3(out, inp, weight, bias, c, oc, epi);
+	else
+		matmul_edge(out, inp, weight, bias, nr, no, c, oc, epi);
+}
+
+/* one input row against the output channels [o0, o1), four at a time */
+static void matmul_gemv(float *out, const float *inp, const float *weight,
+		const float *bias, int c, int o0, int o1, int epi)
+{
+	int o = o0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+	for (; o + 4 <= o1; o += 4) {
+		const float *w = weight + (size_t) o * c;
+		__m256 acc0 = _mm256_setzero_ps();
+		__m256 acc1 = _mm256_setzero_ps();
+		__m256 acc2 = _mm256_setzero_ps();
+		__m256 acc3 = _mm256_setzero_ps();
+		int k;
+		for (k = 0; k + 8 <= c; k += 8) {
+			__m256 x = _mm256_loadu_ps(inp + k);
+			acc0 = _mm256_fmadd_ps(x, _mm256_loadu_ps(w + k), acc0);
+			acc1 = _mm256_fmadd_ps(x,
+					_mm256_loadu_ps(w + c + k), acc1);
+			acc2 = _mm256_fmadd_ps(x,
+					_mm256_loadu_ps(w + 2 * c + k), acc2);
+			acc3 = _mm256_fmadd_ps(x,
+					_mm256_loadu_ps(w + 3 * c + k), acc3);
+		}
+		float v[4] = {
+			hsum256(acc0), hsum256(acc1),
+			hsum256(acc2), hsum256(acc3)
+		};
+		int n;
+		for (n = 0; n < 4; n++) {
+			int m;
+			for (m = k; m < c; m++)
+				v[n] += inp[m] * w[n * c + m];
+			matmul_store(out + o + n, v[n], bias, o + n, epi);
+		}
+	}
+#endif
+
+	for (; o < o1; o++) {
+		float v = dot_f32(inp, weight + (size_t) o * c, c);
+		matmul_store(out + o, v, bias, o, epi);
+	}
+}
+
+/*
+ * matmul_gemv for a packed weight, o0 is the first row of a panel. Two
+ * panels at a time keep six sums in flight. A single row uses each weight
+ * once, so the two sequential panel streams are prefetched PACK_PREFETCH
+ * bytes ahead.
+ */
+#define PACK_PREFETCH 1024
+
+static void matmul_gemv_packed(float *out, const float *inp,
+		const float *weight, const float *bias, int c, int o0, int o1,
+		int epi)
+{
+	int o = o0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+	for (; o + 2 * PACK_ROWS <= o1; o += 2 * PACK_ROWS) {
+		const float *p0 = weight + (size_t) o * c;
+		const float *p1 = p0 + (size_t) PACK_ROWS * c;
+		__m256 acc[6];
+		int j, k;
+		for (j = 0; j < 6; j++)
+			acc[j] = _mm256_setzero_ps();
+		for (k = 0; k < c; k += PACK_K) {
+			const float *w0 = p0 + k * PACK_ROWS;
+			const float *w1 = p1 + k * PACK_ROWS;
+			__m256 x = _mm256_loadu_ps(inp + k);
+			_mm_prefetch((const char *) (w0 + PACK_PREFETCH / 4),
+					_MM_HINT_T0);
+			_mm_prefetch((const char *) (w1 + PACK_PREFETCH / 4),
+					_MM_HINT_T0);
+			for (j = 0; j < 3; j++) {
+				acc[j] = _mm256_fmadd_ps(x,
+					_mm256_loadu_ps(w0 + j * 8), acc[j]);
+				acc[j + 3] = _mm256_fmadd_ps(x,
+					_mm256_loadu_ps(w1 + j * 8),
+					acc[j + 3]);
+			}
+		}
+		for (j = 0; j < 6; j++)
+			matmul_store(out + o + j, hsum256(acc[j]), bias,
+					o + j, epi);
+	}
+#endif
+
+	for (; o < o1; o += PACK_ROWS) {
+		int no = o1 - o < PACK_ROWS ? o1 - o : PACK_ROWS;
+		matmul_panel(out + o, inp, weight + (size_t) o * c,
+				bias != NULL ? bias + o : NULL, 1, no, c, 0,
+				epi);
+	}
+}
+
+/*
+ * bias may be NULL, epi is one of enum matmul_epilogue. A packed weight is
+ * in panels, see PACK_VERSION, and its single row blocks are cut at panels.
+ */
+static MATMUL_NOINLINE void matmul_forward(float *out, float *inp,
+		float *weight, float *bias, int b, int t, int c, int oc,
+		int epi, int packed, int ith, int nth)
+{
+	int bt = b * t;
+	int n, n0, n1;
+
+	if (bt == 1) {
+		int bo = packed ? MATMUL_BLOCK_OC : MATMUL_GEMV_OC;
+		int nob = (oc + bo - 1) / bo;
+		split_work(nob, ith, nth, &n0, &n1);
+		for (n = n0; n < n1; n++) {
+			int o0 = n * bo;
+			int o1 = o0 + bo < oc ? o0 + bo : oc;
+			if (packed)
+				matmul_gemv_packed(out, inp, weight, bias, c,
+						o0, o1, epi);
+			else
+				matmul_gemv(out, inp, weight, bias, c, o0, o1,
+						epi);
+			if (epi == MATMUL_GELU)
+				matmul_gelu(out, 0, 1, o0, o1, oc);
+		}
+		return;
+	}
+
+	int nob = (oc + MATMUL_BLOCK_OC - 1) / MATMUL_BLOCK_OC;
+	int nrb = (bt + MATMUL_BLOCK_BT - 1) / MATMUL_BLOCK_BT;
+
+	split_work(nob * nrb, ith, nth, &n0, &n1);
+	for (n = n0; n < n1; n++) {
+		int i = n / nrb, j = n % nrb;
+		int o0 = i * MATMUL_BLOCK_OC;
+		int o1 = o0 + MATMUL_BLOCK_OC < oc ?
+			o0 + MATMUL_BLOCK_OC : oc;
+		int r0 = j * MATMUL_BLOCK_BT;
+		int r1 = r0 + MATMUL_BLOCK_BT < bt ?
+			r0 + MATMUL_BLOCK_BT : bt;
+		int r, o;
+		for (r = r0; r < r1; r += 4) {
+			int nr = r1 - r < 4 ? r1 - r : 4;
+			for (o = o0; o < o1; o += 3) {
+				int no = o1 - o < 3 ? o1 - o : 3;
+				float *out_ro = out + (size_t) r * oc + o;
+				float *inp_r = inp + (size_t) r * c;
+				float *w_o = weight + (size_t) o * c;
+				float *b_o = bias != NULL ?
+					bias + o : NULL;
+				matmul_tile(out_ro, inp_r, w_o, b_o, nr, no,
+						c, oc, epi, packed);
+			}
+		}
+		if (epi == MATMUL_GELU)
+			matmul_gelu(out, r0, r1, o0, o1, oc);
+	}
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+/* the eight partial int32 sums of one group of 32 int8 products */
+static inline __m256 dot_q8_group(const signed char *a, const signed char *b)
+{
+	__m256i x = _mm256_loadu_si256((const __m256i *) a);
+	__m256i w = _mm256_loadu_si256((const __m256i *) b);
+	/* maddubs wants one unsigned operand: move the sign of x onto w */
+	__m256i ax = _mm256_sign_epi8(x, x);
+	__m256i sw = _mm256_sign_epi8(w, x);
+	__m256i p16 = _mm256_maddubs_epi16(ax, sw);
+	__m256i p32 = _mm256_madd_epi16(p16, _mm256_set1_epi16(1));
+	return _mm256_cvtepi32_ps(p32);
+}
+#endif
+
+static inline float dot_q8(const signed char *a, const float *as,
+		const signed char *b, const float *bs, int n)
+{
+	int g, ng = n / IIMC_Q8_GROUP;
+#if defined(__AVX2__) && defined(__FMA__)
+	__m256 acc = _mm256_setzero_ps();
+	for (g = 0; g < ng; g++) {
+		__m256 d = dot_q8_group(a + g * IIMC_Q8_GROUP,
+				b + g * IIMC_Q8_GROUP);
+		acc = _mm256_fmadd_ps(d, _mm256_set1_ps(as[g] * bs[g]), acc);
+	}
+	return hsum256(acc);
+#else
+	float val = 0.0f;
+	for (g = 0; g < ng; g++) {
+		const signed char *ag = a + g * IIMC_Q8_GROUP;
+		const signed char *bg = b + g * IIMC_Q8_GROUP;
+		int k, sum = 0;
+		for (k = 0; k < IIMC_Q8_GROUP; k++)
+			sum += ag[k] * bg[k];
+		val += sum * as[g] * bs[g];
+	}
+	return val;
+#endif
+}
+
+/* the input rows of matmul_forward_q8, quantized to int8 into xq and xs */
+static void quantize_rows_q8(signed char *xq, float *xs, float *inp,
+		int bt, int c, int ith, int nth)
+{
+	int cg = c / IIMC_Q8_GROUP;
+	int i, i0, i1;
+
+	split_work(bt, ith, nth, &i0, &i1);
+	for (i = i0; i < i1; i++)
+		quantize_q8(xq + (size_t) i * c, xs + (size_t) i * cg,
+				inp + (size_t) i * c, c);
+}
+
+/*
+ * layernorm_forward for a q8 matmul: the normalized rows are quantized to
+ * xq and xs group by group and never stored in fp32.
+ */
+static void layernorm_forward_q8(signed char *xq, float *xs, float *mean,
+		float *rstd, float *inp, float *weight, float *bias,
+		int b, int t, int c, int ith, int nth)
+{
+	int cg = c / IIMC_Q8_GROUP;
+	int r, r0, r1, g, k;
+
+	split_work(b * t, ith, nth, &r0, &r1);
+	for (r = r0; r < r1; r++) {
+		float *x = inp + (size_t) r * c;
+		float m, s;
+		layernorm_stats(x, c, &m, &s);
+
+		for (g = 0; g < cg; g++) {
+			float y[IIMC_Q8_GROUP];
+			int k0 = g * IIMC_Q8_GROUP;
+			for (k = 0; k < IIMC_Q8_GROUP; k++) {
+				float n = s * (x[k0 + k] - m);
+				y[k] = n * weight[k0 + k] + bias[k0 + k];
+			}
+			quantize_q8(xq + (size_t) r * c + k0,
+					xs + (size_t) r * cg + g, y,
+					IIMC_Q8_GROUP);
+		}
+		mean[r] = m;
+		rstd[r] = s;
+	}
+}
+
+/*
+ * Same as matmul_forward for int8 weights. The input rows are quantized to
+ * int8 into xq and xs by quantize_rows_q8 first, so the inner loop is an
+ * integer dot product and only a quarter of the fp32 weight bytes is
+ * streamed.
+ */
+static MATMUL_NOINLINE void matmul_forward_q8(float *out, signed char *xq,
+		float *xs, signed char *weight, float *weight_s, float *bias,
+		int b, int t, int c, int oc, int epi, int ith, int nth)
+{
+	int bt = b * t;
+	int cg = c / IIMC_Q8_GROUP;
+	int n, n0, n1;
+
+	int nob = (oc + MATMUL_GEMV_OC - 1) / MATMUL_GEMV_OC;
+	int nrb = (bt + MATMUL_BLOCK_BT - 1) / MATMUL_BLOCK_BT;
+
+	split_work(nob * nrb, ith, nth, &n0, &n1);
+	for (n = n0; n < n1; n++) {
+		int i = n / nrb, j = n % nrb;
+		int o0 = i * MATMUL_GEMV_OC;
+		int o1 = o0 + MATMUL_GEMV_OC < oc ?
+			o0 + MATMUL_GEMV_OC : oc;
+		int r0 = j * MATMUL_BLOCK_BT;
+		int r1 = r0 + MATMUL_BLOCK_BT < bt ?
+			r0 + MATMUL_BLOCK_BT : bt;
+		int r, o;
+		for (o = o0; o < o1; o++) {
+			signed char *w = weight + (size_t) o * c;
+			float *ws = weight_s + (size_t) o * cg;
+			for (r = r0; r < r1; r++) {
+				float v = dot_q8(xq + (size_t) r * c,
+					xs + (size_t) r * cg,
+					w, ws, c);
+				matmul_store(out + (size_t) r * oc + o, v,
+						bias, o, epi);
+			}
+		}
+		if (epi == MATMUL_GELU)
+			matmul_gelu(out, r0, r1, o0, o1, oc);
+	}
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+static inline __m256 load_bf16(const unsigned short *p)
 {
-	size_t bt = b * t;
+	__m128i h = _mm_loadu_si128((const __m128i *) p);
+	return _mm256_castsi256_ps(
+			_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+}
+#endif
+
+static inline float dot_bf16(const float *a, const unsigned short *b, int n)
+{
+	float val = 0.0f;
+	int k = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+	__m256 acc0 = _mm256_setzero_ps();
+	__m256 acc1 = _mm256_setzero_ps();
+	for (; k + 16 <= n; k += 16) {
+		acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + k),
+				load_bf16(b + k), acc0);
+		acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + k + 8),
+				load_bf16(b + k + 8), acc1);
+	}
+	val = hsum256(_mm256_add_ps(acc0, acc1));
+#endif
+	for (; k < n; k++)
+		val += a[k] * bf16_to_f32(b[k]);
+	return val;
+}
+
+/* matmul_gemv for bf16 weights, widened to fp32 in registers */
+static void matmul_gemv_bf16(float *out, const float *inp,
+		const unsigned short *weight, const float *bias,
+		int c, int o0, int o1, int epi)
+{
+	int o = o0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+	for (; o + 4 <= o1; o += 4) {
+		const unsigned short *w = weight + (size_t) o * c;
+		__m256 acc0 = _mm256_setzero_ps();
+		__m256 acc1 = _mm256_setzero_ps();
+		__m256 acc2 = _mm256_setzero_ps();
+		__m256 acc3 = _mm256_setzero_ps();
+		int k;
+		for (k = 0; k + 8 <= c; k += 8) {
+			__m256 x = _mm256_loadu_ps(inp + k);
+			acc0 = _mm256_fmadd_ps(x, load_bf16(w + k), acc0);
+			acc1 = _mm256_fmadd_ps(x, load_bf16(w + c + k), acc1);
+			acc2 = _mm256_fmadd_ps(x,
+					load_bf16(w + 2 * c + k), acc2);
+			acc3 = _mm256_fmadd_ps(x,
+					load_bf16(w + 3 * c + k), acc3);
+		}
+		float v[4] = {
+			hsum256(acc0), hsum256(acc1),
+			hsum256(acc2), hsum256(acc3)
+		};
+		int n;
+		for (n = 0; n < 4; n++) {
+			int m;
+			for (m = k; m < c; m++)
+				v[n] += inp[m] * bf16_to_f32(w[n * c + m]);
+			matmul_store(out + o + n, v[n], bias, o + n, epi);
+		}
+	}
+#endif
+
+	for (; o < o1; o++) {
+		float v = dot_bf16(inp, weight + (size_t) o * c, c);
+		matmul_store(out + o, v, bias, o, epi);
+	}
+}
+
+/* matmul_gemv_packed for bf16 weights */
+static void matmul_gemv_bf16_packed(float *out, const float *inp,
+		const unsigned short *weight, const float *bias,
+		int c, int o0, int o1, int epi)
+{
+	int o = o0, j, k;
+
+#if defined(__AVX2__) && defined(__FMA__)
+	/* two panels at a time as in matmul_gemv_packed */
+	for (; o + 2 * PACK_ROWS <= o1; o += 2 * PACK_ROWS) {
+		const unsigned short *p0 = weight + (size_t) o * c;
+		const unsigned short *p1 = p0 + (size_t) PACK_ROWS * c;
+		__m256 acc[6];
+		for (j = 0; j < 6; j++)
+			acc[j] = _mm256_setzero_ps();
+		for (k = 0; k < c; k += PACK_K) {
+			const unsigned short *w0 = p0 + k * PACK_ROWS;
+			const unsigned short *w1 = p1 + k * PACK_ROWS;
+			__m256 x = _mm256_loadu_ps(inp + k);
+			_mm_prefetch((const char *) (w0 + PACK_PREFETCH / 2),
+					_MM_HINT_T0);
+			_mm_prefetch((const char *) (w1 + PACK_PREFETCH / 2),
+					_MM_HINT_T0);
+			for (j = 0; j < 3; j++) {
+				acc[j] = _mm256_fmadd_ps(x,
+					load_bf16(w0 + j * 8), acc[j]);
+				acc[j + 3] = _mm256_fmadd_ps(x,
+					load_bf16(w1 + j * 8), acc[j + 3]);
+			}
+		}
+		for (j = 0; j < 6; j++)
+			matmul_store(out + o + j, hsum256(acc[j]), bias,
+					o + j, epi);
+	}
+#endif
+
+	for (; o < o1; o += PACK_ROWS) {
+		const unsigned short *panel = weight + (size_t) o * c;
+		int no = o1 - o < PACK_ROWS ? o1 - o : PACK_ROWS;
+		float val[PACK_ROWS] = { 0.0f };
+#if defined(__AVX2__) && defined(__FMA__)
+		__m256 acc0 = _mm256_setzero_ps();
+		__m256 acc1 = _mm256_setzero_ps();
+		__m256 acc2 = _mm256_setzero_ps();
+		for (k = 0; k < c; k += PACK_K) {
+			const unsigned short *w = panel + k * PACK_ROWS;
+			__m256 x = _mm256_loadu_ps(inp + k);
+			acc0 = _mm256_fmadd_ps(x, load_bf16(w), acc0);
+			acc1 = _mm256_fmadd_ps(x, load_bf16(w + 8), acc1);
+			acc2 = _mm256_fmadd_ps(x, load_bf16(w + 16), acc2);
+		}
+		val[0] = hsum256(acc0);
+		val[1] = hsum256(acc1);
+		val[2] = hsum256(acc2);
+#else
+		for (j = 0; j < PACK_ROWS; j++)
+			for (k = 0; k < c; k++)
+				val[j] += inp[k] *
+					bf16_to_f32(panel[pack_at(j, k)]);
+#endif
+		for (j = 0; j < no; j++)
+			matmul_store(out + o + j, val[j], bias, o + j, epi);
+	}
+}
+
+/*
+ * Same as matmul_forward for bf16 weights. For more than one row, three
+ * weight rows at a time, or one panel, are widened to fp32 on the stack
+ * and shared by all rows of the block through the fp32 register tile.
+ */
+static MATMUL_NOINLINE void matmul_forward_bf16(float *out, float *inp,
+		unsigned short *weight, float *bias, int b, int t, int c,
+		int oc, int epi, int packed, int ith, int nth)
+{
+	int bt = b * t;
+	int n, n0, n1;
+
+	if (bt == 1) {
+		int bo = packed ? MATMUL_BLOCK_OC : MATMUL_GEMV_OC;
+		int nob = (oc + bo - 1) / bo;
+		split_work(nob, ith, nth, &n0, &n1);
+		for (n = n0; n < n1; n++) {
+			int o0 = n * bo;
+			int o1 = o0 + bo < oc ? o0 + bo : oc;
+			if (packed)
+				matmul_gemv_bf16_packed(out, inp, weight,
+						bias, c, o0, o1, epi);
+			else
+				matmul_gemv_bf16(out, inp, weight, bias, c,
+						o0, o1, epi);
+			if (epi == MATMUL_GELU)
+				matmul_gelu(out, 0, 1, o0, o1, oc);
+		}
+		return;
+	}
+
+	int nob = (oc + MATMUL_BLOCK_OC - 1) / MATMUL_BLOCK_OC;
+	int nrb = (bt + MATMUL_BLOCK_BT - 1) / MATMUL_BLOCK_BT;
+
+	split_work(nob * nrb, ith, nth, &n0, &n1);
+	for (n = n0; n < n1; n++) {
+		int i = n / nrb, j = n % nrb;
+		float w[3 * c];
+		int o0 = i * MATMUL_BLOCK_OC;
+		int o1 = o0 + MATMUL_BLOCK_OC < oc ?
+			o0 + MATMUL_BLOCK_OC : oc;
+		int r0 = j * MATMUL_BLOCK_BT;
+		int r1 = r0 + MATMUL_BLOCK_BT < bt ?
+			r0 + MATMUL_BLOCK_BT : bt;
+		int r, o, k;
+		for (o = o0; o < o1; o += 3) {
+			int no = o1 - o < 3 ? o1 - o : 3;
+			int nw = (packed ? PACK_ROWS : no) * c;
+			unsigned short *w_o = weight + (size_t) o * c;
+			float *b_o = bias != NULL ? bias + o : NULL;
+			for (k = 0; k < nw; k++)
+				w[k] = bf16_to_f32(w_o[k]);
+			for (r = r0; r < r1; r += 4) {
+				int nr = r1 - r < 4 ? r1 - r : 4;
+				float *out_ro = out + (size_t) r * oc + o;
+				float *inp_r = inp + (size_t) r * c;
+				matmul_tile(out_ro, inp_r, w, b_o, nr, no,
+						c, oc, epi, packed);
+			}
+		}
+		if (epi == MATMUL_GELU)
+			matmul_gelu(out, r0, r1, o0, o1, oc);
+	}
+}
+
+/*
+ * Attention of one query over n keys and values, stride floats apart.
+ *
+ * The scores are never stored: keys are visited in blocks of ATT_BLOCK and
+ * a running max and sum rescale the partial output whenever a block raises
+ * the max (online softmax), so the work is a single pass over the keys and
+ * values.
+ */
+#define ATT_BLOCK 64
+
+static void attention_head(float *out, const float *query, const float *key,
+		const float *value, int n, int stride, int hs, float scale)
+{
+	float s[ATT_BLOCK];
+	float maxval = -INFINITY;
+	float expsum = 0.0f;
+	int m, i, k;
+
+	for (k = 0; k < hs; k++)
+		out[k] = 0.0f;
+
+	for (m = 0; m < n; m += ATT_BLOCK) {
+		int nb = n - m < ATT_BLOCK ? n - m : ATT_BLOCK;
+		for (i = 0; i < nb; i++) {
+			const float *key_t2 = key + (size_t) (m + i) * stride;
+			s[i] = dot_f32(query, key_t2, hs) * scale;
+		}
+
+		float blockmax = max_f32(s, nb, maxval);
+		if (blockmax > maxval) {
+			float corr = exp_f32(maxval - blockmax);
+			expsum *= corr;
+			for (k = 0; k < hs; k++)
+				out[k] *= corr;
+			maxval = blockmax;
+		}
+
+		expsum += exp_sub_sum(s, s, maxval, nb);
+		for (i = 0; i < nb; i++) {
+			const float *value_t2 = value +
+				(size_t) (m + i) * stride;
+			for (k = 0; k < hs; k++)
+				out[k] += s[i] * value_t2[k];
+		}
+	}
+
+	float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
+	for (k = 0; k < hs; k++)
+		out[k] *= expsum_inv;
+}
+
+void attention_forward(float *out, float *inp, int b, int t, int c, int nh,
+		int ith, int nth)
+{
+	int c3 = 3 * c;
+	int hs = c / nh;
+	float scale = 1.0f / sqrtf(hs);
+
+	int n, n0, n1;
+
+	split_work(b * t * nh, ith, nth, &n0, &n1);
+	for (n = n0; n < n1; n++) {
+		int i = n / (t * nh), j = n / nh % t, k = n % nh;
+		float *inp_b = inp + i * t * c3;
+		attention_head(out + i * t * c + j * c + k * hs,
+				inp_b + j * c3 + k * hs,
+				inp_b + c + k * hs,
+				inp_b + 2 * c + k * hs,
+				j + 1, c3, hs, scale);
+	}
+}
+
+/*
+ * Appends the keys and values of the t new positions of row i to cache
+ * slot slot[i] of ct positions, after the pos[i] it already holds.
+ */
+static void attention_store_kv(float *inp, float *kcache, float *vcache,
+		int *pos, int *slot, int b, int t, int c, int ct, int ith,
+		int nth)
+{
+	int c3 = 3 * c;
+	int n, n0, n1;
+
+	split_work(b * t, ith, nth, &n0, &n1);
+	for (n = n0; n < n1; n++) {
+		int i = n / t, j = n % t;
+		float *qkv_t = inp + (size_t) n * c3;
+		size_t row = ((size_t) slot[i] * ct + pos[i] + j) * c;
+		memcpy(kcache + row, qkv_t + c, c * sizeof(float));
+		memcpy(vcache + row, qkv_t + 2 * c, c * sizeof(float));
+	}
+}
+
+/*
+ * Same as attention_forward, but row i continues the sequence in cache
+ * slot slot[i], which holds pos[i] positions before the t new ones stored
+ * by attention_store_kv. Every query attends over the slot.
+ */
+static void attention_forward_kv(float *out, float *inp, float *kcache,
+		float *vcache, int *pos, int *slot, int b, int t, int c,
+		int nh, int ct, int ith, int nth)
+{
+	int c3 = 3 * c;
+	int hs = c / nh;
+	float scale = 1.0f / sqrtf(hs);
+
+	int n, n0, n1;
+
+	split_work(b * t * nh, ith, nth, &n0, &n1);
+	for (n = n0; n < n1; n++) {
+		int i = n / (t * nh), j = n / nh % t, k = n % nh;
+		size_t row = (size_t) slot[i] * ct * c + k * hs;
+		attention_head(out + i * t * c + j * c + k * hs,
+				inp + i * t * c3 + j * c3 + k * hs,
+				kcache + row, vcache + row,
+				pos[i] + j + 1, c, hs, scale);
+	}
+}
+
+void softmax_forward(float *probs, float *logits, int b, int t, int v,
+		int ith, int nth)
+{
+	int r, r0, r1, k;
+
+	split_work(b * t, ith, nth, &r0, &r1);
+	for (r = r0; r < r1; r++) {
+		float *logits_bt = logits + (size_t) r * v;
+		float *probs_bt = probs + (size_t) r * v;
+		float maxval = max_f32(logits_bt, v, -10000.0f);
+		float sum = exp_sub_sum(probs_bt, logits_bt, maxval, v);
+		float sum_inv = 1.0f / sum;
+		for (k = 0; k < v; k++) {
+			probs_bt[k] *= sum_inv;
+		}
+	}
+}
+
+enum model_weight {
+	WEIGHT_WTE,
+	WEIGHT_QKV,
+	WEIGHT_ATTPROJ,
+	WEIGHT_FC,
+	WEIGHT_FCPROJ
+};
+
+/* bytes of one matmul weight in the model dtype, scales included */
+static double model_weight_bytes(struct iimc_gpt2 *m)
+{
+	if (m->dtype == IIMC_DTYPE_Q8)
+		return 1.0 + (double) sizeof(float) / IIMC_Q8_GROUP;
+	if (m->dtype == IIMC_DTYPE_BF16)
+		return sizeof(unsigned short);
+	return sizeof(float);
+}
+
+/*
+ * One forward pass as run by every thread of the pool. The ops are split
+ * between the threads and separated by a barrier, so a forward pass costs
+ * one dispatch instead of one per parallel loop.
+ */
+struct forward {
+	struct iimc_gpt2 *m;
+	struct iimc_gpt2 *w;	/* weights local to the thread */
+	int *in;
+	int b, t;
+	int *slot, *pos;
+	int *target;
+	int *rows, n_rows;	/* positions with a target */
+	double ctx;	/* positions attended to over all queries */
+	int ith, nth;
+};
+
+/* only thread 0 keeps the time, which includes waiting for the others */
+static inline unsigned long long op_start(struct forward *f)
+{
+	return f->ith == 0 ? prof_start(f->m) : 0;
+}
+
+static inline void op_end(struct forward *f, int op, unsigned long long t0,
+		double flops, double bytes)
+{
+	iimc_pool_barrier(f->m->pool);
+	if (f->ith == 0)
+		prof_stop(f->m, op, t0, flops, bytes);
+}
+
+/*
+ * layernorm_forward in front of a matmul, returns the inp for model_matmul.
+ * With q8 weights the rows are normalized straight into the int8 matmul
+ * input and out is not written, the matmul is then given NULL.
+ */
+static float *model_layernorm(struct forward *f, float *out, float *mean,
+		float *rstd, float *inp, float *weight, float *bias)
+{
+	struct iimc_gpt2 *m = f->m;
+	int c = m->cfg.channels;
+	double btc = (double) f->b * f->t * c;
+	unsigned long long t0 = op_start(f);
+	float *x = out;
+
+	if (m->dtype == IIMC_DTYPE_Q8) {
+		layernorm_forward_q8((signed char *) m->act.q8x, m->act.q8s,
+				mean, rstd, inp, weight, bias, f->b, f->t, c,
+				f->ith, f->nth);
+		x = NULL;
+	} else {
+		layernorm_forward(out, mean, rstd, inp, weight, bias,
+				f->b, f->t, c, f->ith, f->nth);
+	}
+
+	op_end(f, IIMC_OP_LAYERNORM, t0, 8.0 * btc,
+			(2.0 * btc + 2 * c) * sizeof(float));
+	return x;
+}
+
+/*
+ * out = inp * w^T + bias for the weight w of layer l in the model dtype,
+ * finished by the epilogue epi. With q8 weights inp may be NULL if
+ * model_layernorm already left the quantized rows in act.q8x.
+ */
+static void model_matmul(struct forward *f, float *out, float *inp,
+		int id, int l, float *bias, int b, int t, int c, int oc,
+		int epi)
+{
+	static const int op[] = {
+		IIMC_OP_LM_HEAD, IIMC_OP_QKV, IIMC_OP_ATTPROJ, IIMC_OP_FC,
+		IIMC_OP_FCPROJ
+	};
+	struct iimc_gpt2 *m = f->m;
+	struct iimc_gpt2 *w = f->w;
+	int packed = m->packed && id != WEIGHT_WTE;
+	size_t off = (size_t) l * (packed ? pack_rows(oc) : oc) * c;
+	double bt = (double) b * t;
+	unsigned long long t0 = op_start(f);
+
+	if (m->dtype == IIMC_DTYPE_Q8) {
+		signed char *q[] = {
+			w->qparam.wte, w->qparam.qkvw, w->qparam.attprojw,
+			w->qparam.fcw, w->qparam.fcprojw
+		};
+		float *qs[] = {
+			w->qparam.wte_s, w->qparam.qkvw_s,
+			w->qparam.attprojw_s, w->qparam.fcw_s,
+			w->qparam.fcprojw_s
+		};
+		signed char *xq = (signed char *) m->act.q8x;
+		if (inp != NULL) {
+			quantize_rows_q8(xq, m->act.q8s, inp, b * t, c,
+					f->ith, f->nth);
+			iimc_pool_barrier(m->pool);
+		}
+		matmul_forward_q8(out, xq, m->act.q8s, q[id] + off,
+				qs[id] + off / IIMC_Q8_GROUP, bias,
+				b, t, c, oc, epi, f->ith, f->nth);
+	} else if (m->dtype == IIMC_DTYPE_BF16) {
+		unsigned short *h[] = {
+			w->hparam.wte, w->hparam.qkvw, w->hparam.attprojw,
+			w->hparam.fcw, w->hparam.fcprojw
+		};
+		matmul_forward_bf16(out, inp, h[id] + off, bias,
+				b, t, c, oc, epi, packed, f->ith, f->nth);
+	} else {
+		float *fp[] = {
+			w->param.wte, w->param.qkvw, w->param.attprojw,
+			w->param.fcw, w->param.fcprojw
+		};
+		matmul_forward(out, inp, fp[id] + off, bias, b, t, c, oc,
+				epi, packed, f->ith, f->nth);
+	}
+
+	op_end(f, op[id], t0, 2.0 * bt * c * oc,
+			(double) oc * c * model_weight_bytes(m) +
+			bt * (c + oc) * sizeof(float));
+}
+
+/*
+ * The lm head and the cross entropy of the positions with a target,
+ * LOSS_ROWS of them at a time. Only log(sum(exp(logits))) and the logit of
+ * the target are needed, so no probs are written. losses[i] is
+ * -log p(target[i]), and 0 where target[i] < 0.
+ */
+static void model_losses(struct forward *f, float *residual)
+{
+	struct iimc_gpt2 *m = f->m;
+	struct iimc_gpt2 *w = f->w;
+	int c = m->cfg.channels;
 	int v = m->cfg.vocab_size;
-	int l = m->cfg.num_layers;
-	int nh = m->cfg.num_heads;
+	double fsize = sizeof(float);
+	int r, i, i0, i1;
+
+	for (r = 0; r < f->n_rows; r += LOSS_ROWS) {
+		int *rows = f->rows + r;
+		int n = f->n_rows - r < LOSS_ROWS ? f->n_rows - r : LOSS_ROWS;
+
+		unsigned long long t0 = op_start(f);
+		split_work(n, f->ith, f->nth, &i0, &i1);
+		for (i = i0; i < i1; i++)
+			layernorm_forward(m->act.lnf + i * c,
+					m->act.lnf_mean + i,
+					m->act.lnf_rstd + i,
+					residual + (size_t) rows[i] * c,
+					w->param.lnfw, w->param.lnfb,
+					1, 1, c, 0, 1);
+		op_end(f, IIMC_OP_LAYERNORM, t0, 8.0 * n * c,
+				(2.0 * n * c + 2 * c) * fsize);
+
+		model_matmul(f, m->act.logits, m->act.lnf, WEIGHT_WTE, 0,
+				NULL, 1, n, c, v, MATMUL_STORE);
+
+		t0 = op_start(f);
+		for (i = i0; i < i1; i++) {
+			float *logits = m->act.logits + (size_t) i * v;
+			float maxval = max_f32(logits, v, -10000.0f);
+			float sum = exp_sub_total(logits, maxval, v);
+			m->act.losses[rows[i]] = maxval + logf(sum) -
+				logits[f->target[rows[i]]];
+		}
+		op_end(f, IIMC_OP_SOFTMAX, t0, 2.0 * n * v, n * v * fsize);
+	}
+}
+
+static void model_forward_worker(void *arg, int ith, int nth)
+{
+	struct forward f = *(struct forward *) arg;
+	struct iimc_gpt2 *m = f.m;
+	int *in = f.in;
+	int b = f.b;
+	int t = f.t;
+	int *slot = f.slot;
+	int *pos = f.pos;
+
+	f.ith = ith;
+	f.nth = nth;
+	f.w = model_local_weights(m);
+
+	struct iimc_gpt2 *w = f.w;
+
 	int c = m->cfg.channels;
-	m->act_size[ 0] = bt * c;
-	m->act_size[ 1] = l * bt * c;
-	m->act_size[ 2] = l * bt;
-	m->act_size[ 3] = l * bt;
-	m->act_size[ 4] = l * bt * c * 3;
-	m->act_size[ 5] = l * bt * c;
-	m->act_size[ 6] = l * bt * nh * t;
-	m->act_size[ 7] = l * bt * nh * t;
-	m->act_size[ 8] = l * bt * c;
-	m->act_size[ 9] = l * bt * c;
-	m->act_size[10] = l * bt * c;
-	m->act_size[11] = l * bt;
-	m->act_size[12] = l * bt;
-	m->act_size[13] = l * bt * c * 4;
-	m->act_size[14] = l * bt * c * 4;
-	m->act_size[15] = l * bt * c;
-	m->act_size[16] = l * bt * c;
-	m->act_size[17] = bt * c;
-	m->act_size[18] = bt;
-	m->act_size[19] = bt;
-	m->act_size[20] = bt * v;
-	m->act_size[21] = bt * v;
-	m->act_size[22] = bt;
+	int nh = m->cfg.num_heads;
+	int bt = b * t;
+	int btc = bt * c;
+	size_t nkv = (size_t) m->kv.b * m->kv.t * c;
+	double fsize = sizeof(float);
+	unsigned long long t0 = op_start(&f);
+	int i;
+
+	if (m->dtype == IIMC_DTYPE_Q8)
+		encoder_forward_q8(m->act.encoded, in, w->qparam.wte,
+				w->qparam.wte_s, w->param.wpe, pos, b, t, c,
+				ith, nth);
+	else if (m->dtype == IIMC_DTYPE_BF16)
+		encoder_forward_bf16(m->act.encoded, in, w->hparam.wte,
+				w->param.wpe, pos, b, t, c, ith, nth);
+	else
+		encoder_forward(m->act.encoded, in, w->param.wte,
+				w->param.wpe, pos, b, t, c, ith, nth);
+	op_end(&f, IIMC_OP_ENCODER, t0, btc,
+			btc * (model_weight_bytes(m) + 2 * fsize));
+
+	/*
+	 * Only the residual stream and the kv cache outlive a layer. The
+	 * attproj and fcproj matmuls add their output to the stream in place.
+	 */
+	float *residual = m->act.encoded;
+	for (i = 0; i < m->cfg.num_layers; i++) {
+		int ic = i * c;
+		float *x;
+
+		x = model_layernorm(&f, m->act.ln1, m->act.ln1_mean,
+				m->act.ln1_rstd, residual,
+				w->param.ln1w + ic,
+				w->param.ln1b + ic);
+		model_matmul(&f, m->act.qkv, x, WEIGHT_QKV, i,
+				w->param.qkvb + ic * 3, b, t,
+				c, c * 3, MATMUL_STORE);
+		t0 = op_start(&f);
+		if (pos == NULL) {
+			attention_forward(m->act.atty, m->act.qkv,
+					b, t, c, nh, ith, nth);
+		} else {
+			attention_store_kv(m->act.qkv, m->kv.k + i * nkv,
+					m->kv.v + i * nkv, pos, slot,
+					b, t, c, m->kv.t, ith, nth);
+			iimc_pool_barrier(m->pool);
+			attention_forward_kv(m->act.atty, m->act.qkv,
+					m->kv.k + i * nkv, m->kv.v + i * nkv,
+					pos, slot, b, t, c, nh, m->kv.t,
+					ith, nth);
+		}
+		op_end(&f, IIMC_OP_ATTENTION, t0, 4.0 * f.ctx * c,
+				(2.0 * f.ctx * c + 4.0 * btc) * fsize);
+		model_matmul(&f, residual, m->act.atty, WEIGHT_ATTPROJ,
+				i, w->param.attprojb + ic,
+				b, t, c, c, MATMUL_ADD);
+		x = model_layernorm(&f, m->act.ln2, m->act.ln2_mean,
+				m->act.ln2_rstd, residual,
+				w->param.ln2w + ic,
+				w->param.ln2b + ic);
+		model_matmul(&f, m->act.fch, x, WEIGHT_FC, i,
+				w->param.fcb + ic * 4,
+				b, t, c, 4 * c, MATMUL_GELU);
+		model_matmul(&f, residual, m->act.fch,
+				WEIGHT_FCPROJ, i,
+				w->param.fcprojb + ic,
+				b, t, 4 * c, c, MATMUL_ADD);
+	}
+
+	if (m->output & IIMC_OUTPUT_LOSSES) {
+		model_losses(&f, residual);
+		return;
+	}
+
+	/* only the last positions of every row reach the lm head */
+	t0 = op_start(&f);
+	if (m->output & IIMC_OUTPUT_LAST) {
+		int nl = model_output_rows(m, t);
+		int i0, i1;
+		split_work(b * nl, ith, nth, &i0, &i1);
+		for (i = i0; i < i1; i++) {
+			int last = i / nl * t + t - nl + i % nl;
+			layernorm_forward(m->act.lnf + i * c,
+					m->act.lnf_mean + i,
+					m->act.lnf_rstd + i,
+					residual + last * c,
+					w->param.lnfw, w->param.lnfb,
+					1, 1, c, 0, 1);
+		}
+		t = nl;
+	} else {
+		layernorm_forward(m->act.lnf, m->act.lnf_mean,
+				m->act.lnf_rstd, residual,
+				w->param.lnfw, w->param.lnfb,
+				b, t, c, ith, nth);
+	}
+	op_end(&f, IIMC_OP_LAYERNORM, t0, 8.0 * b * t * c,
+			(2.0 * b * t * c + 2 * c) * fsize);
+
+	model_matmul(&f, m->act.logits, m->act.lnf, WEIGHT_WTE, 0, NULL,
+			b, t, c, m->cfg.vocab_size, MATMUL_STORE);
+	if (!(m->output & IIMC_OUTPUT_LOGITS)) {
+		double n = (double) b * t * m->cfg.vocab_size;
+		t0 = op_start(&f);
+		softmax_forward(m->act.probs, m->act.logits, b, t,
+				m->cfg.vocab_size, ith, nth);
+		op_end(&f, IIMC_OP_SOFTMAX, t0, 3.0 * n, 2.0 * n * fsize);
+	}
+}
+
+/*
+ * Runs t tokens of each of the b rows through the stack.
+ *
+ * With slot == NULL every row starts at position 0 and attends only to the
+ * tokens in `in`. Otherwise row i continues the sequence in kv cache slot
+ * slot[i]: it starts at position kv.len[slot[i]], its keys and values are
+ * appended to the slot and attention also covers the positions that are
+ * already cached. kv.len is left for the caller to advance.
+ */
+static void model_forward(struct iimc_gpt2 *m, int *in, int b, int t,
+		int *slot)
+{
+	struct forward f = {
+		.m = m, .in = in, .b = b, .t = t, .slot = slot, .pos = NULL
+	};
+	int i;
+
+	f.ctx = (double) b * t * (t + 1) / 2;
+	if (slot != NULL) {
+		f.pos = m->kv.pos;
+		for (i = 0; i < b; i++) {
+			f.pos[i] = m->kv.len[slot[i]];
+			f.ctx += (double) t * f.pos[i];
+		}
+	}
+
+	iimc_pool_run(m->pool, model_forward_worker, &f);
+}
+
+/*
+ * Runs b rows of t tokens from position 0. With IIMC_OUTPUT_LOSSES target
+ * holds the next token of every position, or -1 for positions to skip,
+ * and only act.losses is computed.
+ */
+int iimc_gpt2_forward(struct iimc_gpt2 *m, int *in, int *target, int b, int t)
+{
+	assert(m != NULL);
+	assert(in != NULL);
+
+	if (!(m->output & IIMC_OUTPUT_LOSSES)) {
+		model_forward(m, in, b, t, NULL);
+		return IIMC_ENONE;
+	}
+
+	assert(target != NULL);
+	assert(!(m->output & IIMC_OUTPUT_LAST));
+
+	int *rows = malloc((size_t) b * t * sizeof(int));
+	if (rows == NULL)
+		return IIMC_ENOMEM;
+
+	int n = 0;
+	int i;
+	for (i = 0; i < b * t; i++) {
+		assert(target[i] < m->cfg.vocab_size);
+		m->act.losses[i] = 0.0f;
+		if (target[i] >= 0)
+			rows[n++] = i;
+	}
+
+	struct forward f = {
+		.m = m, .in = in, .b = b, .t = t, .slot = NULL, .pos = NULL,
+		.target = target, .rows = rows, .n_rows = n
+	};
+	f.ctx = (double) b * t * (t + 1) / 2;
+	iimc_pool_run(m->pool, model_forward_worker, &f);
+
+	free(rows);
+	return IIMC_ENONE;
+}
+
+int iimc_gpt2_prefill(struct iimc_gpt2 *m, int *in, int b, int t)
+{
+	assert(m != NULL);
+	assert(in != NULL);
+	assert(m->kv.k != NULL);
+	assert(b <= m->kv.b);
+
+	if (t > m->kv.t)
+		return IIMC_ECACHE_FULL;
+
+	int i;
+	for (i = 0; i < b; i++)
+		m->kv.len[i] = 0;
+
+	model_forward(m, in, b, t, m->kv.slot);
+
+	for (i = 0; i < b; i++)
+		m->kv.len[i] = t;
+
+	return IIMC_ENONE;
+}
+
+int iimc_gpt2_decode(struct iimc_gpt2 *m, int *in, int b)
+{
+	assert(m != NULL);
+	assert(b <= m->kv.b);
+
+	return iimc_gpt2_decode_slots(m, m->kv.slot, in, b);
+}
+
+int iimc_gpt2_prefill_slot(struct iimc_gpt2 *m, int slot, int *in, int t)
+{
+	assert(m != NULL);
+	assert(in != NULL);
+	assert(m->kv.k != NULL);
+	assert(slot >= 0 && slot < m->kv.b);
+
+	if (t > m->kv.t)
+		return IIMC_ECACHE_FULL;
+
+	m->kv.len[slot] = 0;
+	model_forward(m, in, 1, t, &slot);
+	m->kv.len[slot] = t;
+
+	return IIMC_ENONE;
+}
+
+int iimc_gpt2_append_slot(struct iimc_gpt2 *m, int slot, int *in, int t)
+{
+	assert(m != NULL);
+	assert(in != NULL);
+	assert(m->kv.k != NULL);
+	assert(slot >= 0 && slot < m->kv.b);
+
+	if (m->kv.len[slot] + t > m->kv.t)
+		return IIMC_ECACHE_FULL;
+
+	model_forward(m, in, 1, t, &slot);
+	m->kv.len[slot] += t;
+
+	return IIMC_ENONE;
+}
+
+/* the cached keys (h = 0) or values (h = 1) of layer i at slot, pos */
+static float *model_slot_kv(struct iimc_gpt2 *m, int slot, int h, int i,
+		int pos)
+{
+	size_t nkv = (size_t) m->kv.b * m->kv.t * m->cfg.channels;
+	float *kv = h == 0 ? m->kv.k : m->kv.v;
+	return kv + i * nkv + ((size_t) slot * m->kv.t + pos) *
+		m->cfg.channels;
+}
+
+/* keeps at most the first t cached positions of slot */
+void iimc_gpt2_rewind_slot(struct iimc_gpt2 *m, int slot, int t)
+{
+	assert(m != NULL);
+	assert(m->kv.len != NULL);
+	assert(slot >= 0 && slot < m->kv.b);
+	assert(t >= 0);
+
+	if (m->kv.len[slot] > t)
+		m->kv.len[slot] = t;
+}
+
+/* makes dst continue the sequence cached in src */
+void iimc_gpt2_copy_slot(struct iimc_gpt2 *m, int dst, int src)
+{
+	assert(m != NULL);
+	assert(m->kv.k != NULL);
+	assert(dst >= 0 && dst < m->kv.b);
+	assert(src >= 0 && src < m->kv.b);
+
+	int len = m->kv.len[src];
+	int h, i;
+	if (dst != src)
+		for (h = 0; h < 2; h++)
+			for (i = 0; i < m->cfg.num_layers; i++)
+				memcpy(model_slot_kv(m, dst, h, i, 0),
+						model_slot_kv(m, src, h, i, 0),
+						(size_t) len * m->cfg.channels *
+						sizeof(float));
+	m->kv.len[dst] = len;
+}
+
+/*
+ * A session file holds one sequence so that it continues later without
+ * running its tokens through the model again: a header of 256 ints, the
+ * tokens and, 64 byte aligned, the keys and then the values of the cached
+ * positions, [2][l][len][c] in fp32. header[2] to header[6] repeat the
+ * model shape of the checkpoint, header[7] is the number of tokens,
+ * header[8] the number of cached positions and header[9] and header[10]
+ * the low and high half of the rng state.
+ */
+#define SESSION_MAGIC	20240521
+#define SESSION_VERSION	1
+
+static size_t session_kv_offset(int n)
+{
+	size_t off = 256 * sizeof(int) + n * sizeof(int);
+	return (off + 63) & ~(size_t) 63;
+}
+
+/* writes tokens[0, n) and the kv cache of slot, which caches a prefix */
+int iimc_gpt2_save_session(struct iimc_gpt2 *m, int slot, const char *path,
+		const int *tokens, int n, unsigned long long rng_state)
+{
+	assert(m != NULL);
+	assert(path != NULL);
+	assert(tokens != NULL);
+	assert(slot >= 0 && slot < m->kv.b);
+	assert(m->kv.len[slot] <= n);
+
+	FILE *f = fopen(path, "wb");
+	if (f == NULL)
+		return IIMC_EFILE_NOT_FOUND;
+
+	int len = m->kv.len[slot];
+	int header[256];
+	memset(header, 0, sizeof(header));
+	header[0] = SESSION_MAGIC;
+	header[1] = SESSION_VERSION;
+	header[2] = m->cfg.max_seq_len;
+	header[3] = m->cfg.vocab_size;
+	header[4] = m->cfg.num_layers;
+	header[5] = m->cfg.num_heads;
+	header[6] = m->cfg.channels;
+	header[7] = n;
+	header[8] = len;
+	header[9] = (int) (unsigned int) rng_state;
+	header[10] = (int) (unsigned int) (rng_state >> 32);
+
+	static const char pad[64];
+	size_t gap = session_kv_offset(n) - sizeof(header) - n * sizeof(int);
+	int r = IIMC_ENONE;
+	if (fwrite(header, sizeof(header), 1, f) != 1 ||
+			fwrite(tokens, sizeof(int), n, f) != (size_t) n ||
+			fwrite(pad, 1, gap, f) != gap)
+		r = IIMC_EFILE_BAD_HEADER;
+
+	int h, i;
+	for (h = 0; h < 2 && r == IIMC_ENONE; h++)
+		for (i = 0; i < m->cfg.num_layers && r == IIMC_ENONE; i++)
+			if (fwrite(model_slot_kv(m, slot, h, i, 0),
+					sizeof(float) * m->cfg.channels, len,
+					f) != (size_t) len)
+				r = IIMC_EFILE_BAD_PARAMS;
+
+	if (fclose(f) != 0 && r == IIMC_ENONE)
+		r = IIMC_EFILE_BAD_PARAMS;
+
+	return r;
+}
+
+/*
+ * Maps a session file, copies its cached positions into slot and up to
+ * max of its tokens into tokens. *n gets the number of tokens, the slot
+ * continues from the returned kv.len. Sessions longer than max or than the
+ * kv cache give IIMC_ECACHE_FULL.
+ */
+int iimc_gpt2_load_session(struct iimc_gpt2 *m, int slot, const char *path,
+		int *tokens, int max, int *n, unsigned long long *rng_state)
+{
+	assert(m != NULL);
+	assert(path != NULL);
+	assert(tokens != NULL);
+	assert(n != NULL);
+	assert(rng_state != NULL);
+	assert(m->kv.k != NULL);
+	assert(slot >= 0 && slot < m->kv.b);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return IIMC_EFILE_NOT_FOUND;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < 256 * sizeof(int)) {
+		close(fd);
+		return IIMC_EFILE_BAD_HEADER;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return IIMC_ENOMEM;
+
+	int *header = map;
+	int r = IIMC_ENONE;
+	if (header[0] != SESSION_MAGIC || header[1] != SESSION_VERSION ||
+			header[2] != m->cfg.max_seq_len ||
+			header[3] != m->cfg.vocab_size ||
+			header[4] != m->cfg.num_layers ||
+			header[5] != m->cfg.num_heads ||
+			header[6] != m->cfg.channels ||
+			header[7] < 0 || header[8] < 0 || header[8] > header[7])
+		r = IIMC_EFILE_BAD_HEADER;
+	else if (header[7] > max || header[8] > m->kv.t)
+		r = IIMC_ECACHE_FULL;
+	if (r != IIMC_ENONE) {
+		munmap(map, st.st_size);
+		return r;
+	}
+
+	int len = header[8];
+	size_t row = sizeof(float) * m->cfg.channels;
+	size_t off = session_kv_offset(header[7]);
+	if ((size_t) st.st_size < off + 2 * m->cfg.num_layers * len * row) {
+		munmap(map, st.st_size);
+		return IIMC_EFILE_BAD_PARAMS;
+	}
 
-	model_update_act_count(m);
+	*n = header[7];
+	*rng_state = (unsigned int) header[9] |
+		(unsigned long long) (unsigned int) header[10] << 32;
+	memcpy(tokens, header + 256, *n * sizeof(int));
+
+	const char *kv = (const char *) map + off;
+	int h, i;
+	for (h = 0; h < 2; h++) {
+		for (i = 0; i < m->cfg.num_layers; i++) {
+			memcpy(model_slot_kv(m, slot, h, i, 0), kv, len * row);
+			kv += len * row;
+		}
+	}
+	m->kv.len[slot] = len;
 
+	munmap(map, st.st_size);
 	return IIMC_ENONE;
 }
 
-int iimc_gpt2_init(struct iimc_gpt2 *m, int b, int t)
+int iimc_gpt2_decode_slots(struct iimc_gpt2 *m, int *slots, int *in, int n)
 {
 	assert(m != NULL);
-	int r;
+	assert(slots != NULL);
+	assert(in != NULL);
+	assert(m->kv.k != NULL);
+	assert(n <= m->kv.b);
 
-	r = model_init_acts(m, b, t);
-	if (r != IIMC_ENONE)
-		return r;
+	int i;
+	for (i = 0; i < n; i++) {
+		assert(slots[i] >= 0 && slots[i] < m->kv.b);
+		if (m->kv.len[slots[i]] >= m->kv.t)
+			return IIMC_ECACHE_FULL;
+	}
 
-	r = model_init_acts_new(m);
-	if (r != IIMC_ENONE)
-		return r;
+	model_forward(m, in, n, 1, slots);
+
+	for (i = 0; i < n; i++)
+		m->kv.len[slots[i]]++;
 
 	return IIMC_ENONE;
 }
 
-static void encoder_forward(float *out, int *in, float *wte, float *wpe,
-	       	int b, int t, int c)
-{
-	int i, j, k;
-
-	for (i = 0; i < b; i++) {
-		for (j = 0; j < t; j++) {
-			float *o = out + i * t * c + j * c;
-			int ix = in[i * t + j];
-			float *wte_ix = wte + ix * c;
-			float *wpe_t = wpe + j * c;
-			for (k = 0; k < c; k++) {
-				o[k] = wte_ix[k] + wpe_t[k];
-			}
+static int sample_mult(float *prob, int n, float coin)
+{
+	float cdf = 0.0f;
+	int i;
+	for (i = 0; i < n; i++) {
+		cdf += prob[i];
+		if (coin < cdf) {
+			return i;
 		}
 	}
+	return n - 1;
 }
 
-static void layernorm_forward(float *out, float *mean, float *rstd, float *inp,
-		float *weight, float *bias, int b, int t, int c)
+extern int iimc_gpt2_sample(struct iimc_gpt2 *m, int b, int t,
+		unsigned long long *rng_state)
 {
-	float eps = 1e-5f;
-	int i, j, k;
-
-	for (i = 0; i < b; i++) {
-		for (j = 0; j < t; j++) {
-			float *x = inp + i * t * c + j * c;
-			float m = 0.0f;
-			for (k = 0; k < c; k++) {
-				m += x[k];
-			}
-			m = m / c;
+	int nl = model_output_rows(m, t);
+	int row = b * nl + nl - 1;
+	float *probs = m->act.probs + row * m->cfg.vocab_size;
+	unsigned long long t0 = prof_start(m);
+	float coin = random_f32(rng_state);
+	int r = sample_mult(probs, m->cfg.vocab_size, coin);
+	prof_stop(m, IIMC_OP_SAMPLE, t0, m->cfg.vocab_size,
+			m->cfg.vocab_size * sizeof(float));
+	return r;
+}
 
-			float v = 0.0f;
-			for (k = 0; k < c; k++) {
-				float xshift = x[k] - m;
-				v += xshift * xshift;
-			}
-			v = v / c;
+struct sampler_cand {
+	float logit;
+	int id;
+};
 
-			float s = 1.0f / sqrtf(v + eps);
+struct iimc_sampler {
+	float temperature;
+	int top_k;
+	float top_p;
+	int vocab_size;
+	struct sampler_cand *cand;
+};
 
-			float *o = out + i * t * c + j * c;
-			for (k = 0; k < c; k++) {
-				float n = s * (x[k] - m);
-				o[k] = n * weight[k] + bias[k];
-			}
-			mean[i * t + j] = m;
-			rstd[i * t + j] = s;
-		}
+/*
+ * temperature 0 is greedy decoding, top_k 0 and top_p 1 disable the
+ * respective filter.
+ */
+struct iimc_sampler *iimc_sampler_new(int vocab_size, float temperature,
+		int top_k, float top_p)
+{
+	assert(vocab_size > 0);
+
+	struct iimc_sampler *s = malloc(sizeof(struct iimc_sampler));
+	if (s == NULL)
+		return NULL;
+
+	s->cand = malloc(vocab_size * sizeof(struct sampler_cand));
+	if (s->cand == NULL) {
+		free(s);
+		return NULL;
 	}
+
+	s->vocab_size = vocab_size;
+	s->temperature = temperature < 0.0f ? 0.0f : temperature;
+	s->top_k = (top_k < 0 || top_k > vocab_size) ? 0 : top_k;
+	s->top_p = (top_p <= 0.0f || top_p > 1.0f) ? 1.0f : top_p;
+	return s;
 }
 
-static void matmul_forward(float *out, float *inp, float *weight, float *bias,
-		int b, int t, int c, int oc)
+int iimc_sampler_free(struct iimc_sampler *s)
 {
-	int i, j, k, m;
-#pragma omp parallel for collapse(2)
-	for (i = 0; i < b; i++) {
-		for (j = 0; j < t; j++) {
-			float *out_bt = out + i * t * oc + j * oc;
-			float *inp_bt = inp + i * t * c + j * c;
-			for (k = 0; k < oc; k++) {
-				/* val = (bias != NULL) ? bias[k] : 0.0f; */
-				float val = bias[k];
-				float *wrow = weight + k * c;
-				for (m = 0; m < c; m++) {
-					val += inp_bt[m] * wrow[m];
-				}
-				out_bt[k] = val;
-			}
+	if (s == NULL)
+		return IIMC_ENULL_POINTER_FREE;
+
+	if (s->cand != NULL)
+		free(s->cand);
+
+	memset(s, 0, sizeof(struct iimc_sampler));
+	free(s);
+	return IIMC_ENONE;
+}
+
+static int sample_argmax(float *logits, int n)
+{
+	int i, best = 0;
+	for (i = 1; i < n; i++)
+		if (logits[i] > logits[best])
+			best = i;
+	return best;
+}
+
+static void heap_sift_down(struct sampler_cand *h, int n, int i)
+{
+	for (;;) {
+		int min = i;
+		int l = 2 * i + 1;
+		int r = l + 1;
+		if (l < n && h[l].logit < h[min].logit)
+			min = l;
+		if (r < n && h[r].logit < h[min].logit)
+			min = r;
+		if (min == i)
+			return;
+		struct sampler_cand tmp = h[i];
+		h[i] = h[min];
+		h[min] = tmp;
+		i = min;
+	}
+}
+
+/* the k largest logits via a size k min-heap, O(n log k) without a sort */
+static int sample_select_topk(struct sampler_cand *h, float *logits, int n,
+		int k)
+{
+	int i;
+	for (i = 0; i < k; i++) {
+		h[i].logit = logits[i];
+		h[i].id = i;
+	}
+	for (i = k / 2 - 1; i >= 0; i--)
+		heap_sift_down(h, k, i);
+
+	for (i = k; i < n; i++) {
+		if (logits[i] > h[0].logit) {
+			h[0].logit = logits[i];
+			h[0].id = i;
+			heap_sift_down(h, k, 0);
 		}
 	}
+	return k;
 }
 
-static void matmul_forward_nobias(float *out, float *inp, float *weight, 
-		int b, int t, int c, int oc)
+/*
+ * All tokens that may belong to the top_p nucleus. A token whose probability
+ * is below (1 - top_p) / (n - 1) can never be part of it, so only the
+ * candidates above that bound are kept, the most likely one always.
+ * Returns their count and the softmax normalizer of the whole vocabulary
+ * in *sum.
+ */
+static int sample_select_topp(struct sampler_cand *h, float *logits, int n,
+		float top_p, float inv_t, float *sum)
 {
-	int i, j, k, m;
-#pragma omp parallel for collapse(2)
-	for (i = 0; i < b; i++) {
-		for (j = 0; j < t; j++) {
-			float *out_bt = out + i * t * oc + j * oc;
-			float *inp_bt = inp + i * t * c + j * c;
-			for (k = 0; k < oc; k++) {
-				float val = 0.0f;
-				float *wrow = weight + k * c;
-				for (m = 0; m < c; m++) {
-					val += inp_bt[m] * wrow[m];
-				}
-				out_bt[k] = val;
-			}
+	int i, nc = 0;
+	float maxval = logits[sample_argmax(logits, n)];
+
+	float z = 0.0f;
+	for (i = 0; i < n; i++)
+		z += expf((logits[i] - maxval) * inv_t);
+
+	/* the bound exceeds the largest probability for tiny top_p */
+	float cutoff = (1.0f - top_p) / (n - 1) * z;
+	float min_logit = maxval + logf(cutoff) / inv_t;
+	if (min_logit > maxval)
+		min_logit = maxval;
+	for (i = 0; i < n; i++) {
+		if (logits[i] >= min_logit) {
+			h[nc].logit = logits[i];
+			h[nc].id = i;
+			nc++;
 		}
 	}
+
+	*sum = z;
+	return nc;
 }
 
+static int cand_cmp(const void *a, const void *b)
+{
+	const struct sampler_cand *x = a;
+	const struct sampler_cand *y = b;
+	return (x->logit < y->logit) - (x->logit > y->logit);
+}
 
-void attention_forward(float *out, float *preatt, float *att, float *inp,
-		int b, int t, int c, int nh)
+/*
+ * The top_k or top_p candidates, sorted, the nucleus already cut. Returns
+ * their count and the sum of their exp((logit - max) / t) in *mass.
+ */
+static int sampler_candidates(struct iimc_sampler *s, float *logits,
+		float inv_t, float *mass)
 {
-	int c3 = 3 * c;
-	int hs = c / nh;
-	float scale = 1.0f / sqrtf(hs); 
-
-	int i, j, k, m, n;
-
-#pragma omp parallel for collapse(3)
-	for (i = 0; i < b; i++) {
-	for (j = 0; j < t; j++) {
-	for (k = 0; k < nh; k++) {
-		float *query_t = inp + i * t * c3 + j * c3 + k * hs;
-		float *preatt_bth = preatt + i * nh * t * t + k * t * t + j * t;
-		float *att_bth = att + i * nh * t * t + k * t * t + j * t;
-
-		/* pass 1 */
-		float maxval = -10000.0f;
-		for (m = 0; m <= j; m++) {
-			float *key_t2 = inp + i * t * c3 + 
-				m * c3 + k * hs + c;
-			float val = 0.0f;
-			for (n = 0; n < hs; n++) {
-				val += query_t[n] * key_t2[n];
-			}
-			val *= scale;
-			if (val > maxval) maxval = val;
-			preatt_bth[m] = val;
-		}
+	int n = s->vocab_size;
+	int i, nc;
+	float z = 0.0f;
 
-		/* pass 2 */
-		float expsum = 0.0f;
-		for (m = 0; m <= j; m++) {
-			float expv = expf(preatt_bth[m] - maxval);
-			expsum += expv;
-			att_bth[m] = expv;
-		}
+	if (s->top_k > 0)
+		nc = sample_select_topk(s->cand, logits, n, s->top_k);
+	else
+		nc = sample_select_topp(s->cand, logits, n, s->top_p,
+				inv_t, &z);
 
-		float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
+	qsort(s->cand, nc, sizeof(struct sampler_cand), cand_cmp);
 
-		/* pass 3 */
-		for (m = 0; m < t; m++) {
-			if (m <= j) {
-				att_bth[m] *= expsum_inv;
-			} else {
-				att_bth[m] = 0.0f;
-			}
-		}
+	float maxval = s->cand[0].logit;
+	if (s->top_k > 0) {
+		for (i = 0; i < nc; i++)
+			z += expf((s->cand[i].logit - maxval) * inv_t);
+	}
 
-		/* pass 4 */
-		float *out_bth = out + i * t * c + j * c + k * hs;
-		for (m = 0; m < hs; m++) {
-			out_bth[m] = 0.0f;
-		}
-		for (m = 0; m <= j; m++) {
-			float *value_t2 = inp + i * t * c3 + m * c3
-				+ k * hs + 2 * c;
-			float att_btht2 = att_bth[m];
-			for (n = 0; n < hs; n++) {
-				out_bth[n] += att_btht2 * value_t2[n];
+	/* cut the sorted candidates at top_p of the probability mass */
+	*mass = z;
+	if (s->top_p < 1.0f) {
+		float cdf = 0.0f;
+		for (i = 0; i < nc; i++) {
+			cdf += expf((s->cand[i].logit - maxval) * inv_t);
+			if (cdf >= s->top_p * z) {
+				nc = i + 1;
+				break;
 			}
 		}
+		*mass = cdf;
 	}
-	}
-	}
+
+	return nc;
 }
 
-void gelu_forward(float *out, float *inp, int n)
+/*
+ * Samples one token from the logits of one position. Only top_k or the
+ * top_p candidates are sorted, never the whole vocabulary.
+ */
+int iimc_sampler_sample(struct iimc_sampler *s, float *logits,
+		unsigned long long *rng_state)
 {
-	const float s = sqrt(2.0f / M_PI);
+	assert(s != NULL);
+	assert(logits != NULL);
+
+	int n = s->vocab_size;
 	int i;
-	for (i = 0; i < n; i++) {
-		float x = inp[i];
-		float cube = 0.044715f * x * x * x;
-		out[i] = 0.5f * x * (1.0f + tanhf(s * (x + cube)));
+
+	if (n == 1 || s->temperature == 0.0f || s->top_k == 1)
+		return sample_argmax(logits, n);
+
+	float inv_t = 1.0f / s->temperature;
+	float coin = random_f32(rng_state);
+
+	/* plain multinomial sampling over the whole vocabulary */
+	if (s->top_k == 0 && s->top_p >= 1.0f) {
+		float maxval = logits[sample_argmax(logits, n)];
+		float z = 0.0f;
+		for (i = 0; i < n; i++)
+			z += expf((logits[i] - maxval) * inv_t);
+
+		float target = coin * z;
+		float cdf = 0.0f;
+		for (i = 0; i < n; i++) {
+			cdf += expf((logits[i] - maxval) * inv_t);
+			if (target < cdf)
+				return i;
+		}
+		return n - 1;
+	}
+
+	float mass;
+	int nc = sampler_candidates(s, logits, inv_t, &mass);
+	float maxval = s->cand[0].logit;
+
+	float target = coin * mass;
+	float cdf = 0.0f;
+	for (i = 0; i < nc; i++) {
+		cdf += expf((s->cand[i].logit - maxval) * inv_t);
+		if (target < cdf)
+			return s->cand[i].id;
 	}
+	return s->cand[nc - 1].id;
 }
 
-void residual_forward(float *out, float *inp1, float *inp2, int n)
+/*
+ * The distribution iimc_sampler_sample draws from, over the whole
+ * vocabulary: probs is zero outside the top_k or top_p candidates and
+ * greedy sampling puts all of the mass on the largest logit.
+ */
+void iimc_sampler_probs(struct iimc_sampler *s, float *logits, float *probs)
 {
+	assert(s != NULL);
+	assert(logits != NULL);
+	assert(probs != NULL);
+
+	int n = s->vocab_size;
 	int i;
-	for (i = 0; i < n; i++)
-		out[i] = inp1[i] + inp2[i];
-}
-
-void softmax_forward(float *probs, float *logits, int b, int t, int v)
-{
-	int i, j, k;
-#pragma omp parallel for collapse(2)
-	for (i = 0; i < b; ++i) {
-		for (j = 0; j < t; j++) {
-			float *logits_bt = logits + i * t * v + j * v;
-			float *probs_bt = probs + i * t * v + j * v;
-			float maxval = -10000.0f;
-			for (k = 0; k < v; k++) {
-				if (logits_bt[k] > maxval) {
-					maxval = logits_bt[k];
-				}
-			}
-			float sum = 0.0f;
-			for (k = 0; k < v; k++) {
-				probs_bt[k] = expf(logits_bt[k] - maxval);
-				sum += probs_bt[k];
-			}
-			for (k = 0; k < v; k++) {
-				probs_bt[k] /= sum;
-			}
+
+	if (n == 1 || s->temperature == 0.0f || s->top_k == 1) {
+		memset(probs, 0, n * sizeof(float));
+		probs[sample_argmax(logits, n)] = 1.0f;
+		return;
+	}
+
+	float inv_t = 1.0f / s->temperature;
+
+	if (s->top_k == 0 && s->top_p >= 1.0f) {
+		float maxval = logits[sample_argmax(logits, n)];
+		float z = 0.0f;
+		for (i = 0; i < n; i++) {
+			probs[i] = expf((logits[i] - maxval) * inv_t);
+			z += probs[i];
 		}
+		for (i = 0; i < n; i++)
+			probs[i] /= z;
+		return;
 	}
+
+	float mass;
+	int nc = sampler_candidates(s, logits, inv_t, &mass);
+	float maxval = s->cand[0].logit;
+
+	memset(probs, 0, n * sizeof(float));
+	for (i = 0; i < nc; i++)
+		probs[s->cand[i].id] =
+			expf((s->cand[i].logit - maxval) * inv_t) / mass;
 }
 
-int iimc_gpt2_forward(struct iimc_gpt2 *m, int *in, int *target, int b, int t)
+/*
+ * Speculative decoding. The draft model guesses k tokens one by one, then
+ * the model scores all of them in a single forward pass, which costs about
+ * as much as a decode step as long as the weights dominate. Draft token i
+ * is kept with probability min(1, p(x) / q(x)), p and q being the sampler
+ * distributions of the model and the draft at that position. The first
+ * rejected token is replaced by a sample of max(0, p - q), and if all are
+ * kept, one more token comes from the last p. The tokens are then
+ * distributed exactly as if the model had sampled them on its own, only
+ * more of them come out of every forward pass of the model the better the
+ * draft guesses.
+ */
+struct iimc_spec {
+	struct iimc_gpt2 *draft;	/* not owned */
+	int k;
+	int *in;	/* pending tokens of the model and the guesses */
+	float *p;
+	float *q;	/* k draft distributions */
+	struct iimc_spec_stats stats;
+};
+
+/*
+ * m and draft share the vocabulary and are initialized with the same
+ * kv cache length, m with IIMC_OUTPUT_LOGITS and at least k + 1 in
+ * output_last, draft with IIMC_OUTPUT_LOGITS.
+ */
+struct iimc_spec *iimc_spec_new(struct iimc_gpt2 *m, struct iimc_gpt2 *draft,
+		int k)
 {
 	assert(m != NULL);
-	assert(in != NULL);
+	assert(draft != NULL);
+	assert(k > 0);
+	assert(m->cfg.vocab_size == draft->cfg.vocab_size);
+	assert(m->kv.t <= draft->kv.t);
+	assert(m->output & IIMC_OUTPUT_LOGITS);
+	assert(draft->output & IIMC_OUTPUT_LOGITS);
+	assert(model_output_rows(m, k + 1) == k + 1);
 
-	int bt = b * t;
-	int btc = bt * m->cfg.channels;
-
-	encoder_forward(m->act.encoded, in, m->param.wte, m->param.wpe,
-			b, t, m->cfg.channels);
-
-#if 1
-	/* unrolled i = 0 */
-	layernorm_forward(m->act.ln1, m->act.ln1_mean, m->act.ln1_rstd,
-			m->act.encoded, m->param.ln1w, m->param.ln1b,
-			b, t, m->cfg.channels);
-	matmul_forward(m->act.qkv, m->act.ln1, m->param.qkvw, m->param.qkvb,
-			b, t, m->cfg.channels, 3 * m->cfg.channels);
-	attention_forward(m->act.atty, m->act.preatt, m->act.att, m->act.qkv,
-			b, t, m->cfg.channels, m->cfg.num_heads);
-	matmul_forward(m->act.attproj, m->act.atty, m->param.attprojw,
-			m->param.attprojb, b, t,
-			m->cfg.channels, m->cfg.channels);
-	residual_forward(m->act.residual2, m->act.encoded,
-			m->act.attproj, btc);
-	layernorm_forward(m->act.ln2, m->act.ln2_mean, m->act.ln2_rstd,
-			m->act.residual2, m->param.ln2w, m->param.ln2b,
-			b, t, m->cfg.channels);
-	matmul_forward(m->act.fch, m->act.ln2, m->param.fcw, m->param.fcb,
-			b, t, m->cfg.channels, 4 * m->cfg.channels);
-	gelu_forward(m->act.fch_gelu, m->act.fch, 4 * btc);
-	matmul_forward(m->act.fcproj, m->act.fch_gelu,
-			m->param.fcprojw, m->param.fcprojb,
-			b, t, 4 * m->cfg.channels, m->cfg.channels);
-	residual_forward(m->act.residual3, m->act.residual2,
-			m->act.fcproj, btc);
-#endif
+	struct iimc_spec *sp = calloc(1, sizeof(struct iimc_spec));
+	if (sp == NULL)
+		return NULL;
 
-	int i;
-	for (i = 1; i < m->cfg.num_layers; i++) {
-		float *residual = m->act.residual3 + (i - 1) * btc;
-
-		int ibtc = i * btc;
-		int ibt = i * bt;
-		int ic = i * m->cfg.channels;
-
-		float *l_ln1 = m->act.ln1 + ibtc;
-		float *l_qkv = m->act.qkv + ibtc * 3;
-		float *l_atty = m->act.atty + ibtc;
-		float *l_attproj = m->act.attproj + ibtc;
-		float *l_residual2 = m->act.residual2 + ibtc;
-		float *l_ln2 = m->act.ln2 + ibtc;
-		float *l_fch = m->act.fch + ibtc * 4;
-		float *l_fch_gelu = m->act.fch_gelu + ibtc * 4;
-		float *l_fcproj = m->act.fcproj + ibtc;
-
-		layernorm_forward(l_ln1, m->act.ln1_mean + ibt,
-				m->act.ln1_rstd + ibt, residual, 
-				m->param.ln1w + ic, 
-				m->param.ln1b + ic,
-				b, t, m->cfg.channels);
-		matmul_forward(l_qkv, l_ln1,
-				m->param.qkvw + ic * 3 * m->cfg.channels, 
-				m->param.qkvb + ic * 3, b, t, 
-				m->cfg.channels, m->cfg.channels * 3);
-		attention_forward(l_atty,
-				m->act.preatt + ibt * t * m->cfg.num_heads,
-				m->act.att + ibt * t * m->cfg.num_heads, 
-				l_qkv, b, t, m->cfg.channels,
-				m->cfg.num_heads);
-		matmul_forward(m->act.attproj + ibtc, l_atty, 
-				m->param.attprojw + ic * m->cfg.channels,
-				m->param.attprojb + ic,
-				b, t, m->cfg.channels, m->cfg.channels);
-		residual_forward(l_residual2, residual, l_attproj, btc);
-		layernorm_forward(l_ln2, m->act.ln2_mean + ibt, 
-				m->act.ln2_rstd + ibt, l_residual2, 
-				m->param.ln2w + ic, 
-				m->param.ln2b + ic,
-				b, t, m->cfg.channels);
-		matmul_forward(l_fch, l_ln2,
-				m->param.fcw + ic * 4 * m->cfg.channels,
-				m->param.fcb + ic * 4, 
-				b, t, m->cfg.channels, 4 * m->cfg.channels);
-		gelu_forward(l_fch_gelu, l_fch, btc * 4);
-		matmul_forward(l_fcproj, l_fch_gelu, 
-				m->param.fcprojw + ic * m->cfg.channels * 4,
-				m->param.fcprojb + ic,
-				b, t, 4 * m->cfg.channels, m->cfg.channels);
-		residual_forward(m->act.residual3 + ibtc, l_residual2,
-				l_fcproj, btc);
-	}
-
-	float *residual = m->act.residual3 + (m->cfg.num_layers - 1) * btc;
-	layernorm_forward(m->act.lnf, m->act.lnf_mean,
-			m->act.lnf_rstd, residual,
-			m->param.lnfw, m->param.lnfb,
-			b, t, m->cfg.channels);
-	matmul_forward_nobias(m->act.logits, m->act.lnf, m->param.wte, 
-			b, t, m->cfg.channels, m->cfg.vocab_size);
-	softmax_forward(m->act.probs, m->act.logits, b, t, m->cfg.vocab_size);
+	size_t v = m->cfg.vocab_size;
+	sp->draft = draft;
+	sp->k = k;
+	sp->in = malloc((m->kv.t + k) * sizeof(int));
+	sp->p = malloc(v * sizeof(float));
+	sp->q = malloc(k * v * sizeof(float));
+	if (sp->in == NULL || sp->p == NULL || sp->q == NULL) {
+		iimc_spec_free(sp);
+		return NULL;
+	}
 
-	return IIMC_ENONE;
+	return sp;
 }
 
-static inline unsigned int random_u32(unsigned long long *state)
+int iimc_spec_free(struct iimc_spec *sp)
 {
-	*state ^= *state >> 12;
-	*state ^= *state << 25;
-	*state ^= *state >> 27;
-	return (*state * 0x2545F4914F6CDD1Dull) >> 32;
+	if (sp == NULL)
+		return IIMC_ENULL_POINTER_FREE;
+
+	free(sp->in);
+	free(sp->p);
+	free(sp->q);
+	memset(sp, 0, sizeof(struct iimc_spec));
+	free(sp);
+	return IIMC_ENONE;
 }
 
-static float random_f32(unsigned long long *state)
+const struct iimc_spec_stats *iimc_spec_stats(struct iimc_spec *sp)
 {
-	return (random_u32(state) >> 8) / 16777216.0f;
+	assert(sp != NULL);
+	return &sp->stats;
 }
 
-static int sample_mult(float *prob, int n, float coin)
+/* draws from probs, which sum to mass */
+static int spec_sample(const float *probs, int n, float mass, float coin)
 {
+	float target = coin * mass;
 	float cdf = 0.0f;
-	int i;
+	int i, last = 0;
 	for (i = 0; i < n; i++) {
-		cdf += prob[i];
-		if (coin < cdf) {
+		if (probs[i] <= 0.0f)
+			continue;
+		cdf += probs[i];
+		last = i;
+		if (target < cdf)
 			return i;
+	}
+	return last;
+}
+
+/*
+ * Continues the n tokens of seq in slot of both models by 1 to k + 1
+ * tokens, written to out and counted in *n_out. Each model first catches
+ * up on the tokens of seq past its kv.len[slot], which must be fewer than
+ * n, the newest token being one. Afterwards the caches hold the tokens
+ * seq and out have in common, except for the last token of out.
+ */
+int iimc_spec_step(struct iimc_spec *sp, struct iimc_gpt2 *m,
+		struct iimc_sampler *s, int slot, int *seq, int n, int *out,
+		int *n_out, unsigned long long *rng_state)
+{
+	assert(sp != NULL);
+	assert(m != NULL);
+	assert(s != NULL);
+	assert(seq != NULL);
+	assert(out != NULL);
+	assert(n_out != NULL);
+
+	struct iimc_gpt2 *d = sp->draft;
+	int v = m->cfg.vocab_size;
+	int lm = m->kv.len[slot];
+	int ld = d->kv.len[slot];
+	int k = sp->k;
+	int i, r;
+
+	assert(lm < n && ld < n);
+
+	/* the guesses must fit into the cache of the model */
+	if (n > m->kv.t)
+		return IIMC_ECACHE_FULL;
+	if (k > m->kv.t - n)
+		k = m->kv.t - n;
+
+	int *guess = sp->in + (n - lm);
+	unsigned long long t0 = clock_ns();
+	for (i = 0; i < k; i++) {
+		if (i == 0)
+			r = iimc_gpt2_append_slot(d, slot, seq + ld, n - ld);
+		else
+			r = iimc_gpt2_append_slot(d, slot, guess + i - 1, 1);
+		if (r != IIMC_ENONE)
+			return r;
+
+		float *q = sp->q + (size_t) i * v;
+		int row = model_output_rows(d, i == 0 ? n - ld : 1) - 1;
+		iimc_sampler_probs(s, d->act.logits + (size_t) row * v, q);
+		guess[i] = spec_sample(q, v, 1.0f, random_f32(rng_state));
+	}
+	unsigned long long t1 = clock_ns();
+
+	/* one pass over the pending tokens and the guesses */
+	int t = n - lm + k;
+	memcpy(sp->in, seq + lm, (n - lm) * sizeof(int));
+	r = iimc_gpt2_append_slot(m, slot, sp->in, t);
+	if (r != IIMC_ENONE)
+		return r;
+
+	float *logits = m->act.logits +
+		(size_t) (model_output_rows(m, t) - k - 1) * v;
+	float *p = sp->p;
+	for (i = 0; i < k; i++) {
+		const float *q = sp->q + (size_t) i * v;
+		int x = guess[i];
+
+		iimc_sampler_probs(s, logits + (size_t) i * v, p);
+		if (q[x] <= p[x] || random_f32(rng_state) * q[x] < p[x]) {
+			out[i] = x;
+			continue;
+		}
+
+		/* rejected, the rest of the mass of the model */
+		float mass = 0.0f;
+		int j;
+		for (j = 0; j < v; j++) {
+			p[j] = p[j] > q[j] ? p[j] - q[j] : 0.0f;
+			mass += p[j];
 		}
+		if (mass > 0.0f)
+			out[i] = spec_sample(p, v, mass,
+					random_f32(rng_state));
+		else
+			out[i] = x;
+		break;
 	}
-	return n - 1;
+	if (i == k) {
+		iimc_sampler_probs(s, logits + (size_t) k * v, p);
+		out[k] = spec_sample(p, v, 1.0f, random_f32(rng_state));
+	}
+	unsigned long long t2 = clock_ns();
+
+	/* the guesses after the first rejected one were never there */
+	*n_out = i + 1;
+	m->kv.len[slot] = n + i;
+	iimc_gpt2_rewind_slot(d, slot, n + i);
+
+	sp->stats.steps++;
+	sp->stats.drafted += k;
+	sp->stats.accepted += i;
+	sp->stats.tokens += i + 1;
+	sp->stats.draft_ns += t1 - t0;
+	sp->stats.ns += t2 - t0;
+
+	return IIMC_ENONE;
 }
 
-extern int iimc_gpt2_sample(struct iimc_gpt2 *m, int t,
-		unsigned long long *rng_state)
+/*
+ * Prefix cache. GPT-2 positions are absolute and every sequence starts at
+ * position 0, so the keys and values of a token only depend on the tokens
+ * before it: two prompts that start alike share the cache contents of
+ * their common prefix. The prefixes seen so far form a radix tree over
+ * token ids, where every node holds the tokens of its edge and their keys
+ * and values of all layers. Loading a prompt copies the longest cached
+ * prefix into a kv cache slot and only the rest needs a prefill.
+ *
+ * The nodes sit in a list from the most to the least recently used. Uses
+ * move a whole path there from the leaf up, so a node is never older than
+ * its children and the least recently used one is always a leaf, which
+ * goes first when the budget is exceeded.
+ */
+struct prefix_node {
+	struct prefix_node *parent;
+	struct prefix_node *child;	/* first child */
+	struct prefix_node *next;	/* next sibling */
+	struct prefix_node *newer, *older;
+	int *tok;
+	int len;
+	float *kv;	/* [2][l][len][c] keys then values */
+};
+
+struct iimc_prefix {
+	struct prefix_node root;	/* empty edge, not in the list */
+	struct prefix_node lru;	/* list head, newest is lru.older */
+	int l, c;
+	size_t bytes;
+	size_t budget;
+};
+
+static size_t prefix_bytes(struct iimc_prefix *pc, int len)
 {
-	float *probs = m->act.probs + (t - 1) * m->cfg.vocab_size;
-	float coin = random_f32(rng_state);
-	return sample_mult(probs, m->cfg.vocab_size, coin);
+	return sizeof(struct prefix_node) +
+		len * (sizeof(int) + 2 * sizeof(float) * pc->l * pc->c);
+}
+
+static int prefix_alloc(struct iimc_prefix *pc, int len, int **tok,
+		float **kv)
+{
+	size_t bytes = 2 * sizeof(float) * pc->l * len * pc->c;
+	*tok = malloc(len * sizeof(int));
+	if (*tok == NULL)
+		return IIMC_ENOMEM;
+	if (posix_memalign((void **) kv, 64, bytes) != 0) {
+		free(*tok);
+		return IIMC_ENOMEM;
+	}
+	return IIMC_ENONE;
+}
+
+static struct prefix_node *prefix_node_new(struct iimc_prefix *pc, int len)
+{
+	struct prefix_node *n = calloc(1, sizeof(struct prefix_node));
+	if (n == NULL)
+		return NULL;
+
+	if (prefix_alloc(pc, len, &n->tok, &n->kv) != IIMC_ENONE) {
+		free(n);
+		return NULL;
+	}
+	n->len = len;
+
+	pc->bytes += prefix_bytes(pc, len);
+	return n;
+}
+
+static void prefix_node_free(struct iimc_prefix *pc, struct prefix_node *n)
+{
+	pc->bytes -= prefix_bytes(pc, n->len);
+	free(n->tok);
+	free(n->kv);
+	free(n);
+}
+
+static void prefix_unlink(struct prefix_node *n)
+{
+	n->newer->older = n->older;
+	n->older->newer = n->newer;
+}
+
+/* makes n the most recently used node */
+static void prefix_touch(struct iimc_prefix *pc, struct prefix_node *n)
+{
+	if (n->newer != NULL)
+		prefix_unlink(n);
+	n->newer = &pc->lru;
+	n->older = pc->lru.older;
+	n->older->newer = n;
+	pc->lru.older = n;
+}
+
+/* the keys (h = 0) or values (h = 1) of layer i at position j of n */
+static float *prefix_kv(struct iimc_prefix *pc, struct prefix_node *n, int h,
+		int i, int j)
+{
+	return n->kv + (((size_t) h * pc->l + i) * n->len + j) * pc->c;
+}
+
+/* copies the first count positions of n to slot position pos */
+static void prefix_load_node(struct iimc_prefix *pc, struct prefix_node *n,
+		struct iimc_gpt2 *m, int slot, int pos, int count)
+{
+	int h, i;
+	for (h = 0; h < 2; h++)
+		for (i = 0; i < pc->l; i++)
+			memcpy(model_slot_kv(m, slot, h, i, pos),
+					prefix_kv(pc, n, h, i, 0),
+					count * pc->c * sizeof(float));
+}
+
+/* copies count positions from slot position pos to n */
+static void prefix_store_node(struct iimc_prefix *pc, struct prefix_node *n,
+		struct iimc_gpt2 *m, int slot, int pos, int count)
+{
+	int h, i;
+	for (h = 0; h < 2; h++)
+		for (i = 0; i < pc->l; i++)
+			memcpy(prefix_kv(pc, n, h, i, 0),
+					model_slot_kv(m, slot, h, i, pos),
+					count * pc->c * sizeof(float));
+}
+
+/*
+ * Follows in[0, t) down the tree. Returns the number of matching tokens,
+ * the last node they reach in *last and how many of its tokens match in
+ * *off, which is short of its len if the match ends inside the edge.
+ */
+static int prefix_match(struct iimc_prefix *pc, int *in, int t,
+		struct prefix_node **last, int *off)
+{
+	struct prefix_node *n = &pc->root;
+	int depth = 0;
+
+	*last = n;
+	*off = 0;
+	while (depth < t) {
+		struct prefix_node *ch = n->child;
+		while (ch != NULL && ch->tok[0] != in[depth])
+			ch = ch->next;
+		if (ch == NULL)
+			break;
+
+		int j = 1;
+		while (j < ch->len && depth + j < t &&
+				ch->tok[j] == in[depth + j])
+			j++;
+		depth += j;
+		*last = ch;
+		*off = j;
+		if (j < ch->len)
+			break;
+		n = ch;
+	}
+
+	return depth;
+}
+
+/*
+ * Splits n after off tokens into a new parent with the first off tokens
+ * and n with the rest, returns the new parent.
+ */
+static struct prefix_node *prefix_split(struct iimc_prefix *pc,
+		struct prefix_node *n, int off)
+{
+	struct prefix_node rest = { .len = n->len - off };
+	if (prefix_alloc(pc, rest.len, &rest.tok, &rest.kv) != IIMC_ENONE)
+		return NULL;
+	struct prefix_node *head = prefix_node_new(pc, off);
+	if (head == NULL) {
+		free(rest.tok);
+		free(rest.kv);
+		return NULL;
+	}
+
+	int h, i;
+	memcpy(head->tok, n->tok, off * sizeof(int));
+	memcpy(rest.tok, n->tok + off, rest.len * sizeof(int));
+	for (h = 0; h < 2; h++) {
+		for (i = 0; i < pc->l; i++) {
+			memcpy(prefix_kv(pc, head, h, i, 0),
+					prefix_kv(pc, n, h, i, 0),
+					off * pc->c * sizeof(float));
+			memcpy(prefix_kv(pc, &rest, h, i, 0),
+					prefix_kv(pc, n, h, i, off),
+					rest.len * pc->c * sizeof(float));
+		}
+	}
+
+	/* n keeps its place in the tree and the list with the rest */
+	pc->bytes -= prefix_bytes(pc, n->len) - prefix_bytes(pc, rest.len);
+	free(n->tok);
+	free(n->kv);
+	n->tok = rest.tok;
+	n->kv = rest.kv;
+	n->len = rest.len;
+
+	struct prefix_node **p = &n->parent->child;
+	while (*p != n)
+		p = &(*p)->next;
+	*p = head;
+	head->next = n->next;
+	head->parent = n->parent;
+	head->child = n;
+	n->next = NULL;
+	n->parent = head;
+
+	return head;
+}
+
+/* drops the least recently used node, which is a leaf */
+static void prefix_evict(struct iimc_prefix *pc)
+{
+	struct prefix_node *n = pc->lru.newer;
+	assert(n != &pc->lru && n->child == NULL);
+
+	struct prefix_node **p = &n->parent->child;
+	while (*p != n)
+		p = &(*p)->next;
+	*p = n->next;
+
+	prefix_unlink(n);
+	prefix_node_free(pc, n);
+}
+
+/* a cache for the prefixes of m of up to budget bytes */
+struct iimc_prefix *iimc_prefix_new(struct iimc_gpt2 *m, size_t budget)
+{
+	assert(m != NULL);
+
+	struct iimc_prefix *pc = calloc(1, sizeof(struct iimc_prefix));
+	if (pc == NULL)
+		return NULL;
+
+	pc->l = m->cfg.num_layers;
+	pc->c = m->cfg.channels;
+	pc->budget = budget;
+	pc->lru.newer = &pc->lru;
+	pc->lru.older = &pc->lru;
+
+	return pc;
+}
+
+int iimc_prefix_free(struct iimc_prefix *pc)
+{
+	if (pc == NULL)
+		return IIMC_ENULL_POINTER_FREE;
+
+	while (pc->lru.newer != &pc->lru)
+		prefix_evict(pc);
+	memset(pc, 0, sizeof(struct iimc_prefix));
+	free(pc);
+	return IIMC_ENONE;
+}
+
+/*
+ * Fills slot with the longest cached prefix of in[0, t) and returns its
+ * length, which is also the new kv.len of the slot.
+ */
+int iimc_prefix_load(struct iimc_prefix *pc, struct iimc_gpt2 *m, int slot,
+		int *in, int t)
+{
+	assert(pc != NULL);
+	assert(m != NULL);
+	assert(in != NULL);
+	assert(m->kv.k != NULL);
+	assert(slot >= 0 && slot < m->kv.b);
+	assert(pc->l == m->cfg.num_layers && pc->c == m->cfg.channels);
+
+	struct prefix_node *n;
+	int off;
+	if (t > m->kv.t)
+		t = m->kv.t;
+	int len = prefix_match(pc, in, t, &n, &off);
+
+	/* the path from the leaf up, so parents end up newer */
+	int pos = len;
+	int count = off;
+	for (; n != &pc->root; n = n->parent) {
+		pos -= count;
+		prefix_load_node(pc, n, m, slot, pos, count);
+		prefix_touch(pc, n);
+		count = n->parent->len;
+	}
+
+	m->kv.len[slot] = len;
+	return len;
+}
+
+/*
+ * Adds the first t cached positions of slot, the prefix in[0, t), and
+ * then evicts the least recently used prefixes until the cache fits into
+ * its budget. A prefix larger than the whole budget is not stored.
+ */
+int iimc_prefix_store(struct iimc_prefix *pc, struct iimc_gpt2 *m, int slot,
+		int *in, int t)
+{
+	assert(pc != NULL);
+	assert(m != NULL);
+	assert(in != NULL);
+	assert(slot >= 0 && slot < m->kv.b);
+	assert(t <= m->kv.len[slot]);
+	assert(pc->l == m->cfg.num_layers && pc->c == m->cfg.channels);
+
+	struct prefix_node *n;
+	int off;
+	int len = prefix_match(pc, in, t, &n, &off);
+
+	if (len < t) {
+		if (prefix_bytes(pc, t - len) > pc->budget)
+			return IIMC_ENONE;
+
+		/* a split head must not be left outside the lru list */
+		struct prefix_node *leaf = prefix_node_new(pc, t - len);
+		if (leaf == NULL)
+			return IIMC_ENOMEM;
+		if (off < n->len) {
+			n = prefix_split(pc, n, off);
+			if (n == NULL) {
+				prefix_node_free(pc, leaf);
+				return IIMC_ENOMEM;
+			}
+		}
+
+		memcpy(leaf->tok, in + len, leaf->len * sizeof(int));
+		prefix_store_node(pc, leaf, m, slot, len, leaf->len);
+		leaf->parent = n;
+		leaf->next = n->child;
+		n->child = leaf;
+		n = leaf;
+	}
+
+	for (; n != &pc->root; n = n->parent)
+		prefix_touch(pc, n);
+
+	while (pc->bytes > pc->budget)
+		prefix_evict(pc);
+
+	return IIMC_ENONE;
 }
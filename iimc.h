@@ -12,24 +12,160 @@ enum iimc_error {
 	IIMC_EFILE_BAD_VOCAB_BPE,
 	IIMC_ENULL_POINTER_FREE,
 	IIMC_ENOMEM,
+	IIMC_ECACHE_FULL,
+	IIMC_EBAD_DTYPE,
+	IIMC_ENO_NUMA,
 	IIMC_EUNKNOWN
 };
 
 #define GPT2_EOT 50256
 
+enum iimc_dtype {
+	IIMC_DTYPE_F32 = 0,
+	IIMC_DTYPE_Q8,		/* int8 with one scale per IIMC_Q8_GROUP values */
+	IIMC_DTYPE_BF16
+};
+
+#define IIMC_Q8_GROUP 32
+
+/*
+ * Which positions get logits and probs. Set iimc_gpt2.output before
+ * iimc_gpt2_init, it also sizes the logits and probs buffers. With
+ * IIMC_OUTPUT_LAST row i of the buffers belongs to the last position of
+ * batch row i. If iimc_gpt2.output_last is n > 1, batch row i of a pass
+ * over t positions gets the rows i * m to i * m + m - 1 instead, for its
+ * last m = min(n, t) positions. With IIMC_OUTPUT_LOGITS the softmax is
+ * skipped and there are no probs, e.g. for an iimc_sampler which works on
+ * the logits. IIMC_OUTPUT_LOSSES scores text instead: iimc_gpt2_forward
+ * only fills act.losses with -log p of the targets, the logits serve as
+ * scratch space and there are neither probs nor a kv cache.
+ */
+enum iimc_output {
+	IIMC_OUTPUT_ALL = 0,
+	IIMC_OUTPUT_LAST = 1 << 0,
+	IIMC_OUTPUT_LOGITS = 1 << 1,
+	IIMC_OUTPUT_LOSSES = 1 << 2
+};
+
+/*
+ * A pool of n threads, including the calling one, that runs every forward
+ * pass of a model in one dispatch. cpus, if not NULL, pins thread i to
+ * cpus[i]. Set iimc_gpt2.pool to use it, NULL runs on the calling thread
+ * alone. One pool can serve several models, one forward pass at a time.
+ */
+struct iimc_pool;
+extern struct iimc_pool *iimc_pool_new(int n, const int *cpus);
+extern int iimc_pool_free(struct iimc_pool *p);
+extern int iimc_pool_size(struct iimc_pool *p);
+extern void iimc_pool_run(struct iimc_pool *p,
+		void (*fn)(void *arg, int ith, int nth), void *arg);
+extern void iimc_pool_barrier(struct iimc_pool *p);
+
 struct iimc_gpt2;
 extern struct iimc_gpt2 *iimc_gpt2_new(void);
 extern int iimc_gpt2_free(struct iimc_gpt2 *m);
 
+enum iimc_mmap_flags {
+	IIMC_MMAP_POPULATE = 1 << 0,	/* prefault the whole file at load */
+	IIMC_MMAP_WILLNEED = 1 << 1	/* start asynchronous readahead */
+};
+
 extern int iimc_gpt2_load(struct iimc_gpt2 *m, const char *path);
+extern int iimc_gpt2_load_mmap(struct iimc_gpt2 *m, const char *path,
+		int flags);
+extern int iimc_gpt2_random(struct iimc_gpt2 *m, int max_seq_len,
+		int vocab_size, int num_layers, int num_heads, int channels,
+		unsigned long long seed);
+extern int iimc_gpt2_quantize(struct iimc_gpt2 *m, int dtype);
+extern int iimc_gpt2_pack(struct iimc_gpt2 *m);
+enum iimc_numa {
+	IIMC_NUMA_NONE = 0,
+	IIMC_NUMA_INTERLEAVE,	/* spread the weight pages over all nodes */
+	IIMC_NUMA_REPLICATE	/* one copy of the weights per node */
+};
+
+extern int iimc_gpt2_numa(struct iimc_gpt2 *m, int mode);
+extern int iimc_numa_parse(const char *name);
+extern int iimc_gpt2_save(struct iimc_gpt2 *m, const char *path);
 extern int iimc_gpt2_init(struct iimc_gpt2 *m, int b, int t);
 extern int iimc_gpt2_forward(struct iimc_gpt2 *m, int *in,
 		int *target, int b, int t);
-extern int iimc_gpt2_sample(struct iimc_gpt2 *m, int t,
+extern int iimc_gpt2_prefill(struct iimc_gpt2 *m, int *in, int b, int t);
+extern int iimc_gpt2_decode(struct iimc_gpt2 *m, int *in, int b);
+
+/*
+ * Independent sequences in a batch. Each of the b rows given to
+ * iimc_gpt2_init owns one kv cache slot with its own length.
+ * iimc_gpt2_prefill_slot starts a new sequence of t tokens in one slot,
+ * iimc_gpt2_append_slot continues it with t more tokens and
+ * iimc_gpt2_decode_slots advances n slots by the token in[i] each. Row i
+ * of the logits belongs to slots[i], so finished sequences simply drop out
+ * of the slots array while the others keep going. iimc_gpt2_copy_slot
+ * starts a slot from the cached positions of another one, e.g. to fork a
+ * prompt that was prefilled once.
+ */
+extern int iimc_gpt2_prefill_slot(struct iimc_gpt2 *m, int slot, int *in,
+		int t);
+extern int iimc_gpt2_append_slot(struct iimc_gpt2 *m, int slot, int *in,
+		int t);
+extern int iimc_gpt2_decode_slots(struct iimc_gpt2 *m, int *slots, int *in,
+		int n);
+extern void iimc_gpt2_rewind_slot(struct iimc_gpt2 *m, int slot, int t);
+extern void iimc_gpt2_copy_slot(struct iimc_gpt2 *m, int dst, int src);
+
+/*
+ * Session files keep the tokens, the rng state and the kv cache of one
+ * slot, so a sequence can leave memory and continue later without a
+ * prefill. They only load into a model of the same shape.
+ */
+extern int iimc_gpt2_save_session(struct iimc_gpt2 *m, int slot,
+		const char *path, const int *tokens, int n,
+		unsigned long long rng_state);
+extern int iimc_gpt2_load_session(struct iimc_gpt2 *m, int slot,
+		const char *path, int *tokens, int max, int *n,
+		unsigned long long *rng_state);
+
+/* samples the probs of the last of the t positions of batch row b */
+extern int iimc_gpt2_sample(struct iimc_gpt2 *m, int b, int t,
 		unsigned long long *rng_state);
 
+/*
+ * Per-op profiling. Built with IIMC_PROFILE, every op of the forward pass
+ * adds its wall time, an estimate of its flops and of the bytes it moves to
+ * iimc_gpt2.prof[op] while iimc_gpt2.profile is set. The matmuls are split
+ * by call site. IIMC_OP_SAMPLE is filled by iimc_gpt2_sample, or by the
+ * caller with iimc_prof_now and iimc_gpt2_prof_add around other samplers.
+ * Without IIMC_PROFILE the counters stay zero.
+ */
+enum iimc_op {
+	IIMC_OP_ENCODER = 0,
+	IIMC_OP_LAYERNORM,
+	IIMC_OP_QKV,
+	IIMC_OP_ATTPROJ,
+	IIMC_OP_FC,
+	IIMC_OP_FCPROJ,
+	IIMC_OP_LM_HEAD,
+	IIMC_OP_ATTENTION,
+	IIMC_OP_SOFTMAX,
+	IIMC_OP_SAMPLE,
+	IIMC_NUM_OPS
+};
+
+struct iimc_prof {
+	unsigned long long calls;
+	unsigned long long ns;
+	double flops;
+	double bytes;
+};
+
+extern const char *iimc_op_name(int op);
+extern unsigned long long iimc_prof_now(void);
+extern void iimc_gpt2_prof_add(struct iimc_gpt2 *m, int op,
+		unsigned long long start, double flops, double bytes);
+extern void iimc_gpt2_prof_reset(struct iimc_gpt2 *m);
+
 #define NUM_PARAMETER_TENSORS	16
-#define NUM_ACTIVATION_TENSORS	23
+#define NUM_ACTIVATION_TENSORS	18
 struct iimc_gpt2 {
 	struct {
 		int max_seq_len, vocab_size, num_layers, num_heads, channels;
@@ -39,27 +175,115 @@ struct iimc_gpt2 {
 	size_t param_count;
 	size_t param_bytes;
 	float *params;
+	void *map;
+	size_t map_bytes;
 	struct {
 		float *wte, *wpe, *ln1w, *ln1b, *qkvw, *qkvb,
 		      *attprojw, *attprojb, *ln2w, *ln2b,
 		      *fcw, *fcb, *fcprojw, *fcprojb, *lnfw, *lnfb;
 	} param;
 
+	/* matmul weights when dtype is not IIMC_DTYPE_F32 */
+	int dtype;
+	int packed;	/* in the panels of iimc_gpt2_pack */
+	size_t qparam_bytes;
+	void *qparams;
+	struct {
+		signed char *wte, *qkvw, *attprojw, *fcw, *fcprojw;
+		float *wte_s, *qkvw_s, *attprojw_s, *fcw_s, *fcprojw_s;
+	} qparam;
+	struct {
+		unsigned short *wte, *qkvw, *attprojw, *fcw, *fcprojw;
+	} hparam;
+
+	int output;
+	int output_last;	/* positions per row with IIMC_OUTPUT_LAST */
 	size_t act_size[NUM_ACTIVATION_TENSORS];
 	size_t act_count;
 	size_t act_bytes;
 	float *acts;
 	struct {
 		float *encoded, *ln1, *ln1_mean, *ln1_rstd, *qkv, *atty,
-		      *preatt, *att, *attproj, *residual2, *ln2, *ln2_mean,
-		      *ln2_rstd, *fch, *fch_gelu, *fcproj, *residual3,
-		      *lnf, *lnf_mean, *lnf_rstd, *logits, *probs, *losses;
+		      *ln2, *ln2_mean, *ln2_rstd, *fch,
+		      *lnf, *lnf_mean, *lnf_rstd, *logits, *probs, *losses,
+		      *q8x, *q8s;
 	} act;
+
+	struct iimc_pool *pool;	/* not owned */
+
+	/* weight placement of iimc_gpt2_numa, view[node] has local weights */
+	struct {
+		int mode;
+		int nodes;
+		size_t bytes;
+		void **mem;
+		struct iimc_gpt2 **view;
+	} numa;
+
+	int profile;
+	struct iimc_prof prof[IIMC_NUM_OPS];
+
+	/* per-layer keys and values for incremental decoding */
+	struct {
+		int b, t;
+		int *len;	/* cached positions of each slot */
+		int *pos, *slot;
+		size_t bytes;
+		float *k, *v;
+	} kv;
+};
+
+struct iimc_sampler;
+extern struct iimc_sampler *iimc_sampler_new(int vocab_size,
+		float temperature, int top_k, float top_p);
+extern int iimc_sampler_free(struct iimc_sampler *s);
+extern int iimc_sampler_sample(struct iimc_sampler *s, float *logits,
+		unsigned long long *rng_state);
+extern void iimc_sampler_probs(struct iimc_sampler *s, float *logits,
+		float *probs);
+
+/*
+ * Speculative decoding with a small draft model that shares the
+ * vocabulary, see iimc_spec_step. The stats count the verifying forward
+ * passes of the model, the drafted and the accepted guesses, the tokens
+ * produced and the time spent in total and in the draft.
+ */
+struct iimc_spec_stats {
+	unsigned long long steps;
+	unsigned long long drafted;
+	unsigned long long accepted;
+	unsigned long long tokens;
+	unsigned long long ns;
+	unsigned long long draft_ns;
 };
 
+struct iimc_spec;
+extern struct iimc_spec *iimc_spec_new(struct iimc_gpt2 *m,
+		struct iimc_gpt2 *draft, int k);
+extern int iimc_spec_free(struct iimc_spec *sp);
+extern int iimc_spec_step(struct iimc_spec *sp, struct iimc_gpt2 *m,
+		struct iimc_sampler *s, int slot, int *seq, int n, int *out,
+		int *n_out, unsigned long long *rng_state);
+extern const struct iimc_spec_stats *iimc_spec_stats(struct iimc_spec *sp);
+
+/*
+ * Keys and values of previously seen prompt prefixes, shared by all kv
+ * cache slots of one model and bounded by a budget in bytes.
+ */
+struct iimc_prefix;
+extern struct iimc_prefix *iimc_prefix_new(struct iimc_gpt2 *m,
+		size_t budget);
+extern int iimc_prefix_free(struct iimc_prefix *pc);
+extern int iimc_prefix_load(struct iimc_prefix *pc, struct iimc_gpt2 *m,
+		int slot, int *in, int t);
+extern int iimc_prefix_store(struct iimc_prefix *pc, struct iimc_gpt2 *m,
+		int slot, int *in, int t);
+
 extern struct iimc_bpe *iimc_bpe_new(void);
 extern int iimc_bpe_free(struct iimc_bpe *p);
 extern int iimc_bpe_load(struct iimc_bpe *p, const char *filename);
 extern char *iimc_bpe_decode(struct iimc_bpe *p, int value);
+extern int iimc_bpe_encode(struct iimc_bpe *p, const char *text, size_t n,
+		int *out);
 
 #endif
@@ -12,6 +12,8 @@ struct token_buffer {
 	int buffer_count;
 	int eot_pos;
 	int last_pos;
+	int shift;	/* tokens dropped at once when the window is full */
+	int slides;	/* bumped whenever the window start moves */
 	float oversize_r;
 };
 
@@ -32,6 +34,8 @@ static struct token_buffer *token_buffer_new(int max_seq_len,
 	b->buffer_count = b->max_seq_len * b->oversize_r + 1;
 	b->eot_pos = 0;
 	b->last_pos = 0;
+	b->shift = max_seq_len / 2;
+	b->slides = 0;
 
 	b->buf = malloc(b->buffer_count * sizeof(int));
 	if (b->buf == NULL) {
@@ -54,32 +58,61 @@ static int token_buffer_free(struct token_buffer *p)
 	return IIMC_ENONE;
 }
 
+/*
+ * Reserves the next position and returns the window, which starts with an
+ * end of text token and holds *indx tokens before the new one.
+ *
+ * GPT-2 has absolute positions, so moving the window start invalidates the
+ * whole kv cache. A full window therefore drops its oldest half at once
+ * instead of one token per step: the window is prefilled again once and
+ * the next half window of tokens only need decode steps.
+ */
 static int *token_buffer_step(struct token_buffer *b, int *indx)
 {
 	b->last_pos++;
 
+	/* the window keeps its content, only its place in the buffer moves */
 	if (b->last_pos >= b->buffer_count) {
-		memmove(b->buf, &b->buf[b->eot_pos + 1],
-				(b->max_seq_len - 1) * sizeof(int));
+		int n = b->last_pos - b->eot_pos;
+		memmove(b->buf, &b->buf[b->eot_pos], n * sizeof(int));
 		b->eot_pos = 0;
-		b->last_pos = b->max_seq_len - 1;
+		b->last_pos = n;
 	}
 
-	*indx = b->last_pos;
 	if (b->last_pos - b->eot_pos >= b->max_seq_len) {
-		b->eot_pos = b->last_pos - b->max_seq_len + 1;
-		*indx = b->max_seq_len - 1;
+		b->eot_pos += b->shift;
+		b->slides++;
 	}
 
+	*indx = b->last_pos - b->eot_pos;
+
 	b->buf[b->eot_pos] = GPT2_EOT;
 	return &b->buf[b->eot_pos];
 }
 
+/* the window up to the newest token, starting with its end of text token */
+static int *token_buffer_window(struct token_buffer *b, int *n)
+{
+	*n = b->last_pos - b->eot_pos + 1;
+	return &b->buf[b->eot_pos];
+}
+
 static void token_buffer_update(struct token_buffer *b, int value)
 {
 	b->buf[b->last_pos] = value;
 }
 
+/* appends tokens as if they had been generated, keeping the newest ones */
+static void token_buffer_append(struct token_buffer *b, int *values, int n)
+{
+	int indx;
+	int i;
+	for (i = 0; i < n; i++) {
+		token_buffer_step(b, &indx);
+		token_buffer_update(b, values[i]);
+	}
+}
+
 struct iimc_cfg {
 	const char *mf; /* model file name */
 	const char *tf; /* tokenizer decoding file name */
@@ -88,6 +121,22 @@ struct iimc_cfg {
 	char *prompt;
 	float oversize_r;
 	int seq_len;
+	int batch;
+	int mmap;
+	int dtype;
+	float temperature;
+	int top_k;
+	float top_p;
+	int interactive;
+	int profile;
+	int threads;
+	int *cpus;	/* thread i runs on cpus[i] */
+	int n_cpus;
+	int numa;
+	const char *draft_mf;	/* draft model file name */
+	int guesses;	/* draft tokens per speculative step */
+	const char *resume;	/* session file to continue */
+	const char *save;	/* session file written at exit */
 };
 
 static void iimc_cfg_default(struct iimc_cfg *p)
@@ -99,25 +148,82 @@ static void iimc_cfg_default(struct iimc_cfg *p)
 	p->prompt = NULL;
 	p->oversize_r = 2.0f;
 	p->seq_len = -1;
+	p->batch = 1;
+	p->mmap = 0;
+	p->dtype = IIMC_DTYPE_F32;
+	p->temperature = 1.0f;
+	p->top_k = 0;
+	p->top_p = 1.0f;
+	p->interactive = 0;
+	p->profile = 0;
+	p->threads = 0;
+	p->cpus = NULL;
+	p->n_cpus = 0;
+	p->numa = IIMC_NUMA_NONE;
+	p->draft_mf = NULL;
+	p->guesses = 4;
+	p->resume = NULL;
+	p->save = NULL;
 }
 
 static void print_help()
 {
 	 printf("Usage: iimc [OPTION]... \n"
 		"Run inference for GPT2 model to standard output.\n\n"
+		"  -b\t\tgenerate b independent sequences together\n"
+		"    \t\tEach sequence uses seed s + i and stops at the end of"
+		" text token,\n\t\tafter n tokens or when the sequence length"
+		" is reached.\n"
+		"  -c\t\tpin the threads to a list of cpus such as 0-3,8\n"
 		"  -d\t\tset tokenizer decoding file path\n"
+		"  -D\t\tdecode speculatively with a small draft model file\n"
+		"    \t\tThe draft guesses g tokens ahead, the model checks them"
+		" in one pass.\n\t\tThe output follows the same distribution,"
+		" statistics go to\n\t\tstandard error at exit. The draft is"
+		" loaded with the same -M, -q\n\t\tand -N.\n"
+		"  -g\t\tset the number of draft tokens per step (default"
+		" 4)\n"
 		"  -h\t\tdisplay this help and exit\n"
+		"  -i\t\tread the input from standard input line by line\n"
+		"    \t\tEvery line is appended to the text, then up to n"
+		" tokens are\n\t\tgenerated until the end of text token and a"
+		" newline is printed.\n\t\tWithout a tokenizer a line holds"
+		" token ids.\n"
+		"  -j\t\trun on j threads (default one per cpu in -c, or"
+		" all cpus)\n"
+		"  -k\t\tsample only from the k most likely tokens\n"
 		"  -l\t\tlimit the maximum sequence length\n"
 		"    \t\tThe limit must be less than the model maximum sequence length.\n"
 		"  -m\t\tset model file path\n"
+		"  -M\t\tmap the model file instead of reading it\n"
+		"    \t\tProcesses mapping the same file share one copy"
+		" of the weights.\n"
 		"  -n\t\tgenerate up to n tokens\n"
 		"    \t\tThe number of generated tokens can be larger than the"
-		" model maximum\n\t\tsequence length. In that case, the first"
-		" tokens are omitted to add\n    \t\tnew tokens at the end.\n"
+		" model maximum\n\t\tsequence length. In that case, the oldest"
+		" half of the tokens is\n    \t\tomitted whenever the sequence"
+		" is full.\n"
+		"  -N\t\tplace the weights on the NUMA nodes, interleave"
+		" spreads them\n\t\tover all nodes, replicate keeps a copy"
+		" per node for the threads\n\t\tpinned there with -c\n"
+		"  -P\t\tprint time, flops and bytes per op to standard"
+		" error at exit\n"
+		"  -p\t\tcontinue the given prompt text\n"
+		"    \t\tThe prompt needs the tokenizer decoding file.\n"
+		"  -q\t\tquantize the matmul weights to int8 at load\n"
+		"  -R\t\tcontinue the session saved in a file with -S\n"
+		"    \t\tThe text, the cached model state and the seed"
+		" carry over, so\n\t\tnothing is run through the model"
+		" again.\n"
 		"  -r\t\tset buffer oversize ratio\n"
 		"    \t\tExtend the token buffer between 1.0 and 3.0 times"
 		" the maximum model\n  \t\tsequence length.\n"
+		"  -S\t\tsave the session to a file at exit\n"
 		"  -s\t\tset initial seed\n"
+		"  -t\t\tset sampling temperature\n"
+		"    \t\tA temperature of 0 always picks the most likely token.\n"
+		"  -u\t\tsample only from the smallest set of tokens whose\n"
+		"    \t\tprobabilities add up to at least u (nucleus sampling)\n"
 		"  -v\t\tdisplay version and exit\n");
 }
 
@@ -126,69 +232,489 @@ static void print_version()
 	printf("iimc version 0.1\n");
 }
 
+/* parses "0-3,8" into a list of cpus, returns its length or -1 */
+static int parse_cpus(const char *s, int **cpus)
+{
+	int *list = NULL;
+	int n = 0;
+	char *end;
+
+	for (;;) {
+		long lo = strtol(s, &end, 10);
+		long hi = lo;
+		if (end == s || lo < 0)
+			goto fail;
+		if (*end == '-') {
+			s = end + 1;
+			hi = strtol(s, &end, 10);
+			if (end == s || hi < lo)
+				goto fail;
+		}
+
+		int *p = realloc(list, (n + hi - lo + 1) * sizeof(int));
+		if (p == NULL)
+			goto fail;
+		list = p;
+		for (; lo <= hi; lo++)
+			list[n++] = lo;
+
+		if (*end == '\0')
+			break;
+		if (*end != ',')
+			goto fail;
+		s = end + 1;
+	}
+
+	*cpus = list;
+	return n;
+
+fail:
+	free(list);
+	return -1;
+}
+
 static void parse_cmd(int argc, char *argv[], struct iimc_cfg *p)
 {
 	if (argc < 2)
 		return;
 
 	int opt;
-	while ((opt = getopt(argc, argv, "d:hl:m:n:r:s:v")) != -1) {
+	while ((opt = getopt(argc, argv, "b:c:d:D:g:hij:k:l:m:Mn:N:p:Pqr:R:s:S:t:u:v")) != -1) {
 		switch (opt) {
+			case 'b':
+				p->batch = atoi(optarg);
+				break;
+			case 'c':
+				p->n_cpus = parse_cpus(optarg, &p->cpus);
+				if (p->n_cpus < 0) {
+					fprintf(stderr, "Bad cpu list %s.\n",
+							optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case 'd':
 				p->tf = optarg;
 				break;
+			case 'D':
+				p->draft_mf = optarg;
+				break;
+			case 'g':
+				p->guesses = atoi(optarg);
+				break;
 			case 'h':
 				print_help();
 				exit(EXIT_SUCCESS);
+			case 'i':
+				p->interactive = 1;
+				break;
+			case 'j':
+				p->threads = atoi(optarg);
+				break;
+			case 'k':
+				p->top_k = atoi(optarg);
+				break;
 			case 'l':
 				p->seq_len = atoi(optarg);
 				break;
 			case 'm':
 				p->mf = optarg;
 				break;
+			case 'M':
+				p->mmap = 1;
+				break;
 			case 'n':
 				p->num_token = atoi(optarg);
 				break;
+			case 'N':
+				p->numa = iimc_numa_parse(optarg);
+				if (p->numa < 0) {
+					fprintf(stderr, "Unknown NUMA placement"
+							" %s.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'q':
+				p->dtype = IIMC_DTYPE_Q8;
+				break;
 			case 'r':
 				sscanf(optarg, "%3f", &p->oversize_r);
 				break;
 			case 's':
 				p->rng_state = atoi(optarg);
 				break;
+			case 't':
+				p->temperature = atof(optarg);
+				break;
+			case 'u':
+				p->top_p = atof(optarg);
+				break;
 			case 'v':
 				print_version();
 				exit(EXIT_SUCCESS);
-#if 0
 			case 'p':
 				p->prompt = optarg;
 				break;
-#endif
+			case 'P':
+				p->profile = 1;
+				break;
+			case 'R':
+				p->resume = optarg;
+				break;
+			case 'S':
+				p->save = optarg;
+				break;
 		}
 	}
 }
 
-int main(int argc, char *argv[])
+static void print_tokens(struct iimc_bpe *tokenizer, int decode_tokens,
+		int *tokens, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		if (decode_tokens == 0)
+			printf("%s", iimc_bpe_decode(tokenizer, tokens[i]));
+		else
+			printf("%d ", tokens[i]);
+	}
+}
+
+/* samples logits row i, timed as IIMC_OP_SAMPLE */
+static int sample_row(struct iimc_gpt2 *m, struct iimc_sampler *sampler,
+		int i, unsigned long long *rng_state)
+{
+	int v = m->cfg.vocab_size;
+	unsigned long long t0 = m->profile ? iimc_prof_now() : 0;
+	int value = iimc_sampler_sample(sampler,
+			m->act.logits + (size_t) i * v, rng_state);
+	iimc_gpt2_prof_add(m, IIMC_OP_SAMPLE, t0, 0.0, v * sizeof(float));
+	return value;
+}
+
+static void print_profile(struct iimc_gpt2 *m)
+{
+	unsigned long long total = 0;
+	int i;
+	for (i = 0; i < IIMC_NUM_OPS; i++)
+		total += m->prof[i].ns;
+	if (total == 0) {
+		fprintf(stderr, "No profile, built without IIMC_PROFILE.\n");
+		return;
+	}
+
+	fprintf(stderr, "%-10s %10s %12s %10s %9s %9s %6s\n", "op", "calls",
+			"total ms", "us/call", "GFLOP/s", "GB/s", "%");
+	for (i = 0; i < IIMC_NUM_OPS; i++) {
+		struct iimc_prof *p = &m->prof[i];
+		if (p->calls == 0)
+			continue;
+		double ns = p->ns > 0 ? p->ns : 1;
+		fprintf(stderr, "%-10s %10llu %12.3f %10.3f %9.3f %9.3f %6.2f\n",
+				iimc_op_name(i), p->calls, p->ns * 1e-6,
+				p->ns * 1e-3 / p->calls, p->flops / ns,
+				p->bytes / ns, 100.0 * p->ns / total);
+	}
+	fprintf(stderr, "%-10s %10s %12.3f\n", "total", "", total * 1e-6);
+}
+
+/*
+ * Generates up to cfg->num_token tokens into the token buffer, with
+ * stop_eot also up to the end of text token.
+ *
+ * The kv cache holds the first kv.len[0] tokens of the window as long as
+ * the window start has not moved since *slides, so only the tokens after
+ * them go through the model: the newest one while generating, everything
+ * appended by the input otherwise. Once the window slides, every absolute
+ * position changes and the whole window is prefilled again.
+ */
+static void generate(struct iimc_cfg *cfg, struct iimc_gpt2 *m,
+		struct token_buffer *tb, struct iimc_sampler *sampler,
+		struct iimc_bpe *tokenizer, int decode_tokens, int stop_eot,
+		int *slides)
 {
-	struct iimc_cfg cfg;
-	struct iimc_gpt2 *m;
-	struct token_buffer *tb;
-	struct iimc_bpe *tokenizer;
-	int r;
 	int indx;
-	int decode_tokens = 0;
+	int t;
 
-	iimc_cfg_default(&cfg);
+	for (t = 1; t != cfg->num_token + 1; t++) {
+		int *buffer = token_buffer_step(tb, &indx);
+		int len = m->kv.len[0];
 
-	parse_cmd(argc, argv, &cfg);
+		if (tb->slides == *slides && len < indx)
+			iimc_gpt2_append_slot(m, 0, buffer + len, indx - len);
+		else
+			iimc_gpt2_prefill(m, buffer, 1, indx);
+		*slides = tb->slides;
+
+		int value = sample_row(m, sampler, 0, &cfg->rng_state);
+		token_buffer_update(tb, value);
+		if (stop_eot && value == GPT2_EOT)
+			break;
+
+		print_tokens(tokenizer, decode_tokens, &value, 1);
+		fflush(stdout);
+	}
+}
+
+/*
+ * Like generate, but every step lets the draft model guess and keeps the
+ * guesses the model agrees with plus one token of its own. The tokens of
+ * a step that would not fit before the window slides and those after the
+ * last one needed are dropped, from the kv caches too.
+ */
+static void generate_spec(struct iimc_cfg *cfg, struct iimc_gpt2 *m,
+		struct iimc_gpt2 *draft, struct iimc_spec *spec,
+		struct token_buffer *tb, struct iimc_sampler *sampler,
+		struct iimc_bpe *tokenizer, int decode_tokens, int stop_eot,
+		int *slides)
+{
+	int out[cfg->guesses + 1];
+	int indx = m->kv.len[0];
+	int n, i;
+	int t = 0;
+	int stop = 0;
+
+	while (!stop && t != cfg->num_token) {
+		int *buffer = token_buffer_step(tb, &indx);
+
+		if (tb->slides != *slides || m->kv.len[0] >= indx)
+			iimc_gpt2_rewind_slot(m, 0, 0);
+		iimc_gpt2_rewind_slot(draft, 0, m->kv.len[0]);
+		*slides = tb->slides;
+
+		if (iimc_spec_step(spec, m, sampler, 0, buffer, indx, out, &n,
+					&cfg->rng_state) != IIMC_ENONE) {
+			fprintf(stderr, "Failed to generate.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < n && t != cfg->num_token; i++, t++) {
+			/* the rest did not see the window after it slides */
+			if (i > 0 && indx + 1 >= tb->max_seq_len)
+				break;
+			if (i > 0)
+				buffer = token_buffer_step(tb, &indx);
+			token_buffer_update(tb, out[i]);
+			if (stop_eot && out[i] == GPT2_EOT) {
+				stop = 1;
+				break;
+			}
+
+			print_tokens(tokenizer, decode_tokens, out + i, 1);
+		}
+		fflush(stdout);
+	}
+
+	if (tb->slides == *slides) {
+		iimc_gpt2_rewind_slot(m, 0, indx);
+		iimc_gpt2_rewind_slot(draft, 0, indx);
+	}
+}
+
+static void print_spec_stats(struct iimc_spec *spec)
+{
+	const struct iimc_spec_stats *st = iimc_spec_stats(spec);
+	if (st->steps == 0)
+		return;
+
+	double pass = (double) (st->ns - st->draft_ns) / st->steps;
+	fprintf(stderr, "%llu passes, %llu of %llu guesses accepted (%.1f%%),"
+			" %.2f tokens per pass\n", st->steps, st->accepted,
+			st->drafted, st->drafted > 0 ?
+			100.0 * st->accepted / st->drafted : 0.0,
+			(double) st->tokens / st->steps);
+	fprintf(stderr, "%.3f ms per pass, %.3f ms of draft per pass,"
+			" %.2fx the tokens per second of plain decoding\n",
+			pass * 1e-6, st->draft_ns * 1e-6 / st->steps,
+			st->ns > 0 ? st->tokens * pass / st->ns : 0.0);
+}
+
+/* continues the sequence of a session file in kv cache slot 0 */
+static void resume_session(struct iimc_cfg *cfg, struct iimc_gpt2 *m,
+		struct token_buffer *tb)
+{
+	int *tokens = malloc(cfg->seq_len * sizeof(int));
+	int n = 0;
+	int r = IIMC_ENOMEM;
+	if (tokens != NULL)
+		r = iimc_gpt2_load_session(m, 0, cfg->resume, tokens,
+				cfg->seq_len, &n, &cfg->rng_state);
+	switch (r) {
+		case IIMC_EFILE_NOT_FOUND:
+			fprintf(stderr, "Failed to load session. "
+					"File not found.\n");
+			exit(EXIT_FAILURE);
+		case IIMC_EFILE_BAD_HEADER:
+			fprintf(stderr, "Failed to load session. "
+					"Not a session of this model.\n");
+			exit(EXIT_FAILURE);
+		case IIMC_EFILE_BAD_PARAMS:
+			fprintf(stderr, "Failed to load session. "
+					"Session file is truncated.\n");
+			exit(EXIT_FAILURE);
+		case IIMC_ECACHE_FULL:
+			fprintf(stderr, "Failed to load session. "
+					"Longer than the sequence length.\n");
+			exit(EXIT_FAILURE);
+		case IIMC_ENOMEM:
+			fprintf(stderr, "Failed to load session. "
+					"Memory allocation error.\n");
+			exit(EXIT_FAILURE);
+		case IIMC_ENONE:
+			break;
+		default:
+			fprintf(stderr, "Failed to load session. "
+					"Unknown error.\n");
+			exit(EXIT_FAILURE);
+	}
+
+	/* the window brings its own end of text token */
+	if (n > 1)
+		token_buffer_append(tb, tokens + 1, n - 1);
+	free(tokens);
+}
+
+/* turns one line of input into tokens, text or token ids */
+static int read_tokens(struct iimc_bpe *tokenizer, int decode_tokens,
+		int vocab_size, char *line, size_t n, int *out)
+{
+	if (decode_tokens == 0)
+		return iimc_bpe_encode(tokenizer, line, n, out);
+
+	char *p = line;
+	char *end;
+	int count = 0;
+	for (;;) {
+		long value = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		if (value < 0 || value >= vocab_size)
+			return -1;
+		out[count++] = value;
+		p = end;
+	}
+	while (*p == ' ' || *p == '\t' || *p == '\n')
+		p++;
+
+	return *p == '\0' ? count : -1;
+}
+
+/*
+ * Generates cfg->batch sequences that continue the same prompt, one per
+ * kv cache slot. The prompt is prefilled once and its cached positions
+ * are copied to the other slots. Every step feeds the newest token of all unfinished
+ * sequences through a single decode, so the matmuls see one row per
+ * sequence. A sequence has its own rng and leaves the batch on the end of
+ * text token, after cfg->num_token tokens or when its slot is full. The
+ * sequences are printed in order once all of them are done.
+ */
+static int generate_batch(struct iimc_cfg *cfg, struct iimc_gpt2 *m,
+		struct iimc_sampler *sampler, struct iimc_bpe *tokenizer,
+		int decode_tokens, int *prompt, int n_prompt)
+{
+	int b = cfg->batch;
+	int max_gen = cfg->seq_len + 1;
+	int r = IIMC_ENONE;
+	int i, j;
+
+	unsigned long long *rng = malloc(b * sizeof(*rng));
+	int *count = calloc(b, sizeof(int));
+	int *active = malloc(b * sizeof(int));
+	int *next = malloc(b * sizeof(int));
+	int *gen = malloc((size_t) b * max_gen * sizeof(int));
+	int *prefix = malloc((n_prompt + 1) * sizeof(int));
+	if (rng == NULL || count == NULL || active == NULL || next == NULL ||
+			gen == NULL || prefix == NULL) {
+		r = IIMC_ENOMEM;
+		goto out;
+	}
+
+	/* like the token buffer, keep the newest tokens that fit */
+	int n = n_prompt + 1;
+	prefix[0] = GPT2_EOT;
+	memcpy(prefix + 1, prompt, n_prompt * sizeof(int));
+	if (n > cfg->seq_len) {
+		memmove(prefix, prefix + n - cfg->seq_len,
+				cfg->seq_len * sizeof(int));
+		n = cfg->seq_len;
+	}
+
+	/* one prefill, every slot forks it and samples with its own rng */
+	r = iimc_gpt2_prefill_slot(m, 0, prefix, n);
+	if (r != IIMC_ENONE)
+		goto out;
+
+	int n_active = 0;
+	for (i = 0; i < b; i++) {
+		rng[i] = cfg->rng_state + i;
+		iimc_gpt2_copy_slot(m, i, 0);
+
+		int value = sample_row(m, sampler, 0, &rng[i]);
+		if (value == GPT2_EOT || cfg->num_token == 0)
+			continue;
+		gen[i * max_gen + count[i]++] = value;
+		if (count[i] == cfg->num_token || n >= cfg->seq_len)
+			continue;
+		active[n_active] = i;
+		next[n_active++] = value;
+	}
+
+	while (n_active > 0) {
+		r = iimc_gpt2_decode_slots(m, active, next, n_active);
+		if (r != IIMC_ENONE)
+			goto out;
+
+		/* sample every row, then drop the finished sequences */
+		int kept = 0;
+		for (j = 0; j < n_active; j++) {
+			int slot = active[j];
+			int value = sample_row(m, sampler, j, &rng[slot]);
+			if (value == GPT2_EOT)
+				continue;
+			gen[slot * max_gen + count[slot]++] = value;
+			if (count[slot] == cfg->num_token ||
+					m->kv.len[slot] >= cfg->seq_len)
+				continue;
+			active[kept] = slot;
+			next[kept++] = value;
+		}
+		n_active = kept;
+	}
 
-	m = iimc_gpt2_new();
+	for (i = 0; i < b; i++) {
+		if (cfg->prompt != NULL)
+			printf("%s", cfg->prompt);
+		print_tokens(tokenizer, decode_tokens,
+				gen + i * max_gen, count[i]);
+		printf("\n");
+		if (i < b - 1)
+			printf("\n");
+	}
+
+out:
+	free(prefix);
+	free(gen);
+	free(next);
+	free(active);
+	free(count);
+	free(rng);
+	return r;
+}
+
+/* loads, quantizes and places a model the way cfg asks, or exits */
+static struct iimc_gpt2 *load_model(struct iimc_cfg *cfg, const char *mf)
+{
+	struct iimc_gpt2 *m = iimc_gpt2_new();
 	if (m == NULL) {
 		fprintf(stderr, "Failed to allocate memory for model. "
 				"Likely out of memory.\n");
 		exit(EXIT_FAILURE);
 	}
 
-	r = iimc_gpt2_load(m, cfg.mf);
+	int r;
+	if (cfg->mmap)
+		r = iimc_gpt2_load_mmap(m, mf, IIMC_MMAP_WILLNEED);
+	else
+		r = iimc_gpt2_load(m, mf);
 	switch (r) {
 		case IIMC_EFILE_NOT_FOUND:
 			fprintf(stderr, "Failed to load model. "
@@ -198,6 +724,10 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "Failed to load model. "
 					"Model file has a bad header.\n");
 			exit(EXIT_FAILURE);
+		case IIMC_EFILE_BAD_PARAMS:
+			fprintf(stderr, "Failed to load model. "
+					"Model file is truncated.\n");
+			exit(EXIT_FAILURE);
 		case IIMC_ENOMEM:
 			fprintf(stderr, "Failed to load model. "
 					"Memory allocation error.\n");
@@ -210,10 +740,128 @@ int main(int argc, char *argv[])
 			exit(EXIT_FAILURE);
 	}
 
+	r = IIMC_ENONE;
+	if (cfg->dtype != IIMC_DTYPE_F32)
+		r = iimc_gpt2_quantize(m, cfg->dtype);
+	switch (r) {
+		case IIMC_EBAD_DTYPE:
+			fprintf(stderr, "Failed to quantize model. "
+					"Unsupported model type or shape.\n");
+			exit(EXIT_FAILURE);
+		case IIMC_ENOMEM:
+			fprintf(stderr, "Failed to quantize model. "
+					"Memory allocation error.\n");
+			exit(EXIT_FAILURE);
+		case IIMC_ENONE:
+			break;
+		default:
+			fprintf(stderr, "Failed to quantize model. "
+					"Unknown error.\n");
+			exit(EXIT_FAILURE);
+	}
+
+	r = iimc_gpt2_numa(m, cfg->numa);
+	switch (r) {
+		case IIMC_ENO_NUMA:
+			fprintf(stderr, "Failed to place model. "
+					"Built without NUMA support or no"
+					" NUMA system.\n");
+			exit(EXIT_FAILURE);
+		case IIMC_ENOMEM:
+			fprintf(stderr, "Failed to place model. "
+					"Memory allocation error.\n");
+			exit(EXIT_FAILURE);
+		case IIMC_ENONE:
+			break;
+		default:
+			fprintf(stderr, "Failed to place model. "
+					"Unknown error.\n");
+			exit(EXIT_FAILURE);
+	}
+
+	return m;
+}
+
+int main(int argc, char *argv[])
+{
+	struct iimc_cfg cfg;
+	struct iimc_gpt2 *m;
+	struct iimc_gpt2 *draft = NULL;
+	struct iimc_spec *spec = NULL;
+	struct token_buffer *tb;
+	struct iimc_bpe *tokenizer;
+	struct iimc_sampler *sampler;
+	int r;
+	int decode_tokens = 0;
+	int *prompt = NULL;
+	int n_prompt = 0;
+
+	iimc_cfg_default(&cfg);
+
+	parse_cmd(argc, argv, &cfg);
+
+	m = load_model(&cfg, cfg.mf);
+	if (cfg.draft_mf != NULL)
+		draft = load_model(&cfg, cfg.draft_mf);
+
 	if (cfg.seq_len < 1)
 		cfg.seq_len = m->cfg.max_seq_len;
+	if (cfg.batch < 1) {
+		fprintf(stderr, "The batch size must be at least 1.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (draft != NULL) {
+		if (draft->cfg.vocab_size != m->cfg.vocab_size) {
+			fprintf(stderr, "The draft model needs the same"
+					" vocabulary as the model.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (cfg.seq_len > draft->cfg.max_seq_len)
+			cfg.seq_len = draft->cfg.max_seq_len;
+		if (cfg.batch > 1 || cfg.guesses < 1) {
+			fprintf(stderr, "The draft model needs a batch size"
+					" of 1 and at least 1 guess.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (cfg.batch > 1 && (cfg.resume != NULL || cfg.save != NULL)) {
+		fprintf(stderr, "Sessions need a batch size of 1.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (cfg.batch > 1 && cfg.interactive) {
+		fprintf(stderr, "Interactive mode needs a batch size of 1.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (cfg.threads < 1)
+		cfg.threads = cfg.n_cpus > 0 ? cfg.n_cpus :
+			sysconf(_SC_NPROCESSORS_ONLN);
+	if (cfg.threads < 1)
+		cfg.threads = 1;
+	if (cfg.n_cpus > 0 && cfg.n_cpus < cfg.threads) {
+		fprintf(stderr, "The cpu list needs one cpu per thread.\n");
+		exit(EXIT_FAILURE);
+	}
+	m->pool = iimc_pool_new(cfg.threads, cfg.cpus);
+	if (m->pool == NULL) {
+		fprintf(stderr, "Failed to start %d threads.\n", cfg.threads);
+		exit(EXIT_FAILURE);
+	}
 
-	r = iimc_gpt2_init(m, 1, cfg.seq_len);
+	m->output = IIMC_OUTPUT_LAST | IIMC_OUTPUT_LOGITS;
+	m->profile = cfg.profile;
+	if (draft != NULL) {
+		m->output_last = cfg.guesses + 1;
+		draft->pool = m->pool;
+		draft->output = IIMC_OUTPUT_LAST | IIMC_OUTPUT_LOGITS;
+		r = iimc_gpt2_init(draft, 1, cfg.seq_len);
+		if (r != IIMC_ENONE) {
+			fprintf(stderr, "Failed to init draft model.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	r = iimc_gpt2_init(m, cfg.batch, cfg.seq_len);
 	switch (r) {
 		case IIMC_ENOMEM:
 			fprintf(stderr, "Failed to init model. "
@@ -227,33 +875,142 @@ int main(int argc, char *argv[])
 			exit(EXIT_FAILURE);
 	}
 
+	if (draft != NULL) {
+		spec = iimc_spec_new(m, draft, cfg.guesses);
+		if (spec == NULL) {
+			fprintf(stderr, "Failed to init speculative decoding."
+					"\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	tb = token_buffer_new(cfg.seq_len, cfg.oversize_r);
 	if (tb == NULL) {
 		fprintf(stderr, "Failed to init token buffer.\n");
 		exit(EXIT_FAILURE);
 	}
 
+	sampler = iimc_sampler_new(m->cfg.vocab_size, cfg.temperature,
+			cfg.top_k, cfg.top_p);
+	if (sampler == NULL) {
+		fprintf(stderr, "Failed to init sampler.\n");
+		exit(EXIT_FAILURE);
+	}
+
 	tokenizer = iimc_bpe_new();
 	if (iimc_bpe_load(tokenizer, cfg.tf) != IIMC_ENONE)
 		decode_tokens = 1;
 
-	for (int t = 1; t != cfg.num_token + 1; t++) {
-		int *buffer = token_buffer_step(tb, &indx);
-		iimc_gpt2_forward(m, buffer, NULL, 1, indx);
-		int value = iimc_gpt2_sample(m, indx, &cfg.rng_state);
-		token_buffer_update(tb, value);
+	if (cfg.prompt != NULL) {
+		size_t len = strlen(cfg.prompt);
+		prompt = malloc((len + 1) * sizeof(int));
+		n_prompt = -1;
 
-		if (decode_tokens == 0) 
-			printf("%s", iimc_bpe_decode(tokenizer, value));
-		else
-			printf("%d ", value);
+		if (decode_tokens == 0 && prompt != NULL)
+			n_prompt = iimc_bpe_encode(tokenizer, cfg.prompt, len,
+					prompt);
+		if (n_prompt < 0) {
+			fprintf(stderr, "Failed to encode prompt.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (cfg.batch > 1) {
+		r = generate_batch(&cfg, m, sampler, tokenizer, decode_tokens,
+				prompt, n_prompt);
+		if (r != IIMC_ENONE) {
+			fprintf(stderr, "Failed to generate batch.\n");
+			exit(EXIT_FAILURE);
+		}
+		goto out;
+	}
+
+	if (cfg.resume != NULL)
+		resume_session(&cfg, m, tb);
+
+	if (cfg.prompt != NULL) {
+		token_buffer_append(tb, prompt, n_prompt);
+		printf("%s", cfg.prompt);
+	}
 
+	int slides = 0;
+	if (!cfg.interactive || cfg.prompt != NULL) {
+		if (spec != NULL)
+			generate_spec(&cfg, m, draft, spec, tb, sampler,
+					tokenizer, decode_tokens, 0, &slides);
+		else
+			generate(&cfg, m, tb, sampler, tokenizer,
+					decode_tokens, 0, &slides);
+		printf("\n");
 		fflush(stdout);
 	}
-	printf("\n");
 
+	if (cfg.interactive) {
+		char *line = NULL;
+		size_t cap = 0;
+		ssize_t len;
+		int *tokens = NULL;
+
+		while ((len = getline(&line, &cap, stdin)) > 0) {
+			int *p = realloc(tokens, (len + 1) * sizeof(int));
+			if (p == NULL) {
+				fprintf(stderr, "Failed to read input. "
+						"Memory allocation error.\n");
+				exit(EXIT_FAILURE);
+			}
+			tokens = p;
+
+			int n = read_tokens(tokenizer, decode_tokens,
+					m->cfg.vocab_size, line, len, tokens);
+			if (n < 0) {
+				fprintf(stderr, "Failed to encode input.\n");
+				continue;
+			}
+
+			token_buffer_append(tb, tokens, n);
+			if (spec != NULL)
+				generate_spec(&cfg, m, draft, spec, tb,
+						sampler, tokenizer,
+						decode_tokens, 1, &slides);
+			else
+				generate(&cfg, m, tb, sampler, tokenizer,
+						decode_tokens, 1, &slides);
+			printf("\n");
+			fflush(stdout);
+		}
+
+		free(tokens);
+		free(line);
+	}
+
+	if (cfg.save != NULL) {
+		int n;
+		int *window = token_buffer_window(tb, &n);
+		/* positions cached before the window slid are stale */
+		if (tb->slides != slides)
+			iimc_gpt2_rewind_slot(m, 0, 0);
+		if (iimc_gpt2_save_session(m, 0, cfg.save, window, n,
+					cfg.rng_state) != IIMC_ENONE) {
+			fprintf(stderr, "Failed to save session.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+out:
+	if (cfg.profile)
+		print_profile(m);
+	if (spec != NULL)
+		print_spec_stats(spec);
+
+	free(prompt);
 	iimc_bpe_free(tokenizer);
+	iimc_sampler_free(sampler);
 	token_buffer_free(tb);
+	iimc_spec_free(spec);
+	iimc_pool_free(m->pool);
+	if (draft != NULL)
+		iimc_gpt2_free(draft);
 	iimc_gpt2_free(m);
+	free(cfg.cpus);
 	return 0;
 }
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "iimc.h"
+
+static void print_help()
+{
+	 printf("Usage: iimc-pack [OPTION]... INPUT OUTPUT\n"
+		"Rewrite a GPT2 model file with the matmul weights in the "
+		"order the\nkernels read them.\n\n"
+		"  -b\t\tconvert an fp32 model to bf16 first\n"
+		"  -h\t\tdisplay this help and exit\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct iimc_gpt2 *m;
+	int bf16 = 0;
+	int opt;
+	int r;
+
+	while ((opt = getopt(argc, argv, "bh")) != -1) {
+		switch (opt) {
+			case 'b':
+				bf16 = 1;
+				break;
+			case 'h':
+				print_help();
+				exit(EXIT_SUCCESS);
+			default:
+				print_help();
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (argc - optind != 2) {
+		print_help();
+		exit(EXIT_FAILURE);
+	}
+
+	m = iimc_gpt2_new();
+	if (m == NULL) {
+		fprintf(stderr, "Failed to allocate memory for model. "
+				"Likely out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	r = iimc_gpt2_load_mmap(m, argv[optind], 0);
+	if (r != IIMC_ENONE) {
+		fprintf(stderr, "Failed to load model %s.\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (bf16) {
+		r = iimc_gpt2_quantize(m, IIMC_DTYPE_BF16);
+		if (r != IIMC_ENONE) {
+			fprintf(stderr, "Failed to convert model.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	r = iimc_gpt2_pack(m);
+	if (r != IIMC_ENONE) {
+		fprintf(stderr, "Failed to pack model.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	r = iimc_gpt2_save(m, argv[optind + 1]);
+	if (r != IIMC_ENONE) {
+		fprintf(stderr, "Failed to write model %s.\n",
+				argv[optind + 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	iimc_gpt2_free(m);
+	return 0;
+}
@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "iimc.h"
+
+/*
+ * A fixed set of worker threads that run one function together.
+ *
+ * iimc_pool_run hands fn to all threads at once and the calling thread
+ * takes part as thread 0, so a forward pass costs a single dispatch and the
+ * kernels inside it only meet at iimc_pool_barrier. Waiting threads spin
+ * for POOL_SPIN rounds, which covers the gap between two ops or two decode
+ * steps, and then give the core away: idle workers park on a condition
+ * variable, threads at a barrier yield.
+ */
+#define POOL_SPIN (1 << 14)
+
+struct iimc_pool {
+	int n;
+	pthread_t *threads;
+
+	void (*fn)(void *arg, int ith, int nth);
+	void *arg;
+
+	atomic_int generation;	/* bumped by every iimc_pool_run */
+	atomic_int pending;	/* workers still inside fn */
+	atomic_int sleeping;	/* workers parked on cond */
+	atomic_int stop;
+
+	atomic_int arrived;	/* threads at the current barrier */
+	atomic_int phase;	/* bumped when all threads arrived */
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	const int *cpus;
+};
+
+struct pool_worker {
+	struct iimc_pool *p;
+	int ith;
+};
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	_mm_pause();
+#endif
+}
+
+static void pool_pin(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void *pool_main(void *arg)
+{
+	struct pool_worker *w = arg;
+	struct iimc_pool *p = w->p;
+	int ith = w->ith;
+	int gen = 0;
+	free(w);
+
+	if (p->cpus != NULL)
+		pool_pin(p->cpus[ith]);
+
+	for (;;) {
+		int i;
+		for (i = 0; i < POOL_SPIN; i++) {
+			if (atomic_load(&p->generation) != gen)
+				break;
+			cpu_relax();
+		}
+
+		if (i == POOL_SPIN) {
+			/* sleeping is raised before generation is checked */
+			pthread_mutex_lock(&p->lock);
+			atomic_fetch_add(&p->sleeping, 1);
+			while (atomic_load(&p->generation) == gen &&
+					!atomic_load(&p->stop))
+				pthread_cond_wait(&p->cond, &p->lock);
+			atomic_fetch_sub(&p->sleeping, 1);
+			pthread_mutex_unlock(&p->lock);
+		}
+
+		if (atomic_load(&p->stop))
+			return NULL;
+
+		gen = atomic_load(&p->generation);
+		p->fn(p->arg, ith, p->n);
+		atomic_fetch_sub(&p->pending, 1);
+	}
+}
+
+/*
+ * n threads including the calling one. With cpus, thread i is pinned to
+ * cpus[i], the calling thread to cpus[0]. cpus must outlive the pool.
+ */
+struct iimc_pool *iimc_pool_new(int n, const int *cpus)
+{
+	assert(n > 0);
+
+	struct iimc_pool *p = calloc(1, sizeof(struct iimc_pool));
+	if (p == NULL)
+		return NULL;
+
+	p->n = n;
+	p->cpus = cpus;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	p->threads = calloc(n, sizeof(pthread_t));
+	if (p->threads == NULL) {
+		free(p);
+		return NULL;
+	}
+
+	if (cpus != NULL)
+		pool_pin(cpus[0]);
+
+	int i;
+	for (i = 1; i < n; i++) {
+		struct pool_worker *w = malloc(sizeof(struct pool_worker));
+		if (w == NULL)
+			break;
+		w->p = p;
+		w->ith = i;
+		if (pthread_create(&p->threads[i], NULL, pool_main, w) != 0) {
+			free(w);
+			break;
+		}
+	}
+
+	if (i < n) {
+		p->n = i;
+		iimc_pool_free(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+int iimc_pool_free(struct iimc_pool *p)
+{
+	if (p == NULL)
+		return IIMC_ENULL_POINTER_FREE;
+
+	pthread_mutex_lock(&p->lock);
+	atomic_store(&p->stop, 1);
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	int i;
+	for (i = 1; i < p->n; i++)
+		pthread_join(p->threads[i], NULL);
+
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p->threads);
+	memset(p, 0, sizeof(struct iimc_pool));
+	free(p);
+	return IIMC_ENONE;
+}
+
+int iimc_pool_size(struct iimc_pool *p)
+{
+	return p == NULL ? 1 : p->n;
+}
+
+/* runs fn(arg, ith, n) on all n threads and returns when all are done */
+void iimc_pool_run(struct iimc_pool *p, void (*fn)(void *arg, int ith,
+			int nth), void *arg)
+{
+	if (p == NULL || p->n == 1) {
+		fn(arg, 0, 1);
+		return;
+	}
+
+	p->fn = fn;
+	p->arg = arg;
+	atomic_store(&p->pending, p->n - 1);
+	atomic_fetch_add(&p->generation, 1);
+
+	if (atomic_load(&p->sleeping) > 0) {
+		pthread_mutex_lock(&p->lock);
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	fn(arg, 0, p->n);
+
+	int i = 0;
+	while (atomic_load(&p->pending) > 0) {
+		if (++i < POOL_SPIN)
+			cpu_relax();
+		else
+			sched_yield();
+	}
+}
+
+/* every thread inside iimc_pool_run waits here until all have arrived */
+void iimc_pool_barrier(struct iimc_pool *p)
+{
+	if (p == NULL || p->n == 1)
+		return;
+
+	int phase = atomic_load(&p->phase);
+	if (atomic_fetch_add(&p->arrived, 1) == p->n - 1) {
+		atomic_store(&p->arrived, 0);
+		atomic_fetch_add(&p->phase, 1);
+		return;
+	}
+
+	int i = 0;
+	while (atomic_load(&p->phase) == phase) {
+		if (++i < POOL_SPIN)
+			cpu_relax();
+		else
+			sched_yield();
+	}
+}
@@ -0,0 +1,355 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "iimc.h"
+
+/*
+ * iimc-ppl scores a token file with a model and prints its perplexity.
+ *
+ * The file is mapped and read as windows of t tokens that start s tokens
+ * apart, so every token but the first is predicted from at least t - s
+ * tokens of context once the first window is done. A token is scored by
+ * the first window that predicts it. b windows go through the model in
+ * one forward pass, which only computes the losses of the scored tokens.
+ *
+ * Token files of llm.c, a header of 256 ints followed by uint16 ids, are
+ * recognized by their header. Any other file is a plain array of uint16
+ * or, with -w 4, int32 ids.
+ */
+
+#define PPL_MAGIC	20240520
+
+struct ppl_cfg {
+	const char *mf;
+	const char *tokf;
+	const char *out;
+	int mmap;
+	int dtype;
+	int numa;
+	int threads;
+	int batch;
+	int window;
+	int stride;
+	int width;
+};
+
+struct ppl_tokens {
+	void *map;
+	size_t map_bytes;
+	const void *ids;
+	int width;
+	long n;
+};
+
+static void print_help()
+{
+	 printf("Usage: iimc-ppl [OPTION]... FILE\n"
+		"Score the tokens of FILE with a GPT2 model and print the"
+		" perplexity.\n\n"
+		"  -b\t\tscore b windows in one forward pass (default 4)\n"
+		"  -h\t\tdisplay this help and exit\n"
+		"  -j\t\trun on j threads (default all cpus)\n"
+		"  -l\t\tset the window length (default the model maximum"
+		" sequence length)\n"
+		"  -m\t\tset model file path\n"
+		"  -M\t\tmap the model file instead of reading it\n"
+		"  -N\t\tplace the weights on the NUMA nodes, interleave"
+		" or replicate\n"
+		"  -o\t\twrite the log probability of every scored token to"
+		" a file,\n\t\tone fp32 per token from the second one on\n"
+		"  -q\t\tquantize the matmul weights to int8 at load\n"
+		"  -s\t\tset the distance between windows (default half a"
+		" window)\n"
+		"  -w\t\tbytes per token id of files without header, 2 or 4"
+		" (default 2)\n");
+}
+
+static void ppl_default(struct ppl_cfg *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->mf = "gpt2_124M.bin";
+	p->dtype = IIMC_DTYPE_F32;
+	p->batch = 4;
+	p->width = 2;
+}
+
+static void parse_cmd(int argc, char *argv[], struct ppl_cfg *p)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "b:hj:l:m:MN:o:qs:w:")) != -1) {
+		switch (opt) {
+			case 'b':
+				p->batch = atoi(optarg);
+				break;
+			case 'h':
+				print_help();
+				exit(EXIT_SUCCESS);
+			case 'j':
+				p->threads = atoi(optarg);
+				break;
+			case 'l':
+				p->window = atoi(optarg);
+				break;
+			case 'm':
+				p->mf = optarg;
+				break;
+			case 'M':
+				p->mmap = 1;
+				break;
+			case 'N':
+				p->numa = iimc_numa_parse(optarg);
+				if (p->numa < 0) {
+					fprintf(stderr, "Unknown NUMA placement"
+							" %s.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'o':
+				p->out = optarg;
+				break;
+			case 'q':
+				p->dtype = IIMC_DTYPE_Q8;
+				break;
+			case 's':
+				p->stride = atoi(optarg);
+				break;
+			case 'w':
+				p->width = atoi(optarg);
+				break;
+			default:
+				print_help();
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 1) {
+		print_help();
+		exit(EXIT_FAILURE);
+	}
+	p->tokf = argv[optind];
+}
+
+static int ppl_tokens_map(struct ppl_tokens *tk, const char *path, int width)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return IIMC_EFILE_NOT_FOUND;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return IIMC_EFILE_BAD_TOKENS;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return IIMC_ENOMEM;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	tk->map = map;
+	tk->map_bytes = st.st_size;
+	tk->ids = map;
+	tk->width = width;
+	tk->n = st.st_size / width;
+
+	const int *header = map;
+	if (st.st_size >= 256 * sizeof(int) && header[0] == PPL_MAGIC) {
+		tk->ids = header + 256;
+		tk->width = sizeof(unsigned short);
+		tk->n = header[2];
+		if (header[1] != 1 || tk->n < 0 || st.st_size <
+				256 * sizeof(int) + tk->n * tk->width) {
+			munmap(map, st.st_size);
+			return IIMC_EFILE_BAD_TOKENS;
+		}
+	}
+
+	return IIMC_ENONE;
+}
+
+/* token i, exits on ids outside the vocabulary of m */
+static int ppl_token(struct ppl_tokens *tk, long i, struct iimc_gpt2 *m)
+{
+	int x;
+	if (tk->width == sizeof(unsigned short))
+		x = ((const unsigned short *) tk->ids)[i];
+	else
+		x = ((const int *) tk->ids)[i];
+
+	if (x < 0 || x >= m->cfg.vocab_size) {
+		fprintf(stderr, "Token %ld is out of the vocabulary.\n", i);
+		exit(EXIT_FAILURE);
+	}
+	return x;
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+	struct ppl_cfg cfg;
+	struct ppl_tokens tk;
+	struct iimc_gpt2 *m;
+	int r;
+
+	ppl_default(&cfg);
+	parse_cmd(argc, argv, &cfg);
+
+	if (cfg.width != 2 && cfg.width != 4) {
+		fprintf(stderr, "Token ids have 2 or 4 bytes.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (cfg.batch < 1) {
+		fprintf(stderr, "The batch size must be at least 1.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	r = ppl_tokens_map(&tk, cfg.tokf, cfg.width);
+	if (r != IIMC_ENONE) {
+		fprintf(stderr, "Failed to map tokens %s.\n", cfg.tokf);
+		exit(EXIT_FAILURE);
+	}
+	if (tk.n < 2) {
+		fprintf(stderr, "Scoring needs at least 2 tokens.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	m = iimc_gpt2_new();
+	if (m == NULL) {
+		fprintf(stderr, "Failed to allocate memory for model. "
+				"Likely out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (cfg.mmap)
+		r = iimc_gpt2_load_mmap(m, cfg.mf, IIMC_MMAP_WILLNEED);
+	else
+		r = iimc_gpt2_load(m, cfg.mf);
+	if (r != IIMC_ENONE) {
+		fprintf(stderr, "Failed to load model %s.\n", cfg.mf);
+		exit(EXIT_FAILURE);
+	}
+
+	if (cfg.dtype != IIMC_DTYPE_F32 &&
+			iimc_gpt2_quantize(m, cfg.dtype) != IIMC_ENONE) {
+		fprintf(stderr, "Failed to quantize model.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (iimc_gpt2_numa(m, cfg.numa) != IIMC_ENONE) {
+		fprintf(stderr, "Failed to place model on the NUMA nodes.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* t tokens predict the t after them, the last window is moved back */
+	int t = cfg.window;
+	if (t < 1 || t > m->cfg.max_seq_len)
+		t = m->cfg.max_seq_len;
+	if (t > tk.n - 1)
+		t = tk.n - 1;
+	int s = cfg.stride;
+	if (s < 1 || s > t)
+		s = t / 2 > 0 ? t / 2 : 1;
+
+	if (cfg.threads < 1)
+		cfg.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	m->pool = iimc_pool_new(cfg.threads > 0 ? cfg.threads : 1, NULL);
+	if (m->pool == NULL) {
+		fprintf(stderr, "Failed to start %d threads.\n", cfg.threads);
+		exit(EXIT_FAILURE);
+	}
+
+	m->output = IIMC_OUTPUT_LOSSES;
+	if (iimc_gpt2_init(m, cfg.batch, t) != IIMC_ENONE) {
+		fprintf(stderr, "Failed to init model.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	FILE *out = NULL;
+	if (cfg.out != NULL) {
+		out = fopen(cfg.out, "wb");
+		if (out == NULL) {
+			fprintf(stderr, "Failed to open %s.\n", cfg.out);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	size_t bt = (size_t) cfg.batch * t;
+	int *in = malloc(bt * sizeof(int));
+	int *target = malloc(bt * sizeof(int));
+	float *logp = malloc(bt * sizeof(float));
+	if (in == NULL || target == NULL || logp == NULL) {
+		fprintf(stderr, "Failed to allocate token buffers.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	double t0 = now_s();
+	double nll = 0.0;
+	long next = 1;	/* first token not scored yet */
+	long start = 0;
+	int i, j;
+
+	while (next < tk.n) {
+		int b = 0;
+		int n = 0;
+		for (; b < cfg.batch && next < tk.n; b++, start += s) {
+			long st = start < tk.n - 1 - t ? start : tk.n - 1 - t;
+			for (j = 0; j < t; j++) {
+				long k = st + j;
+				in[b * t + j] = ppl_token(&tk, k, m);
+				target[b * t + j] = k + 1 >= next ?
+					ppl_token(&tk, k + 1, m) : -1;
+			}
+			next = st + t + 1;
+		}
+
+		if (iimc_gpt2_forward(m, in, target, b, t) != IIMC_ENONE) {
+			fprintf(stderr, "Failed to score tokens.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < b * t; i++) {
+			if (target[i] < 0)
+				continue;
+			nll += m->act.losses[i];
+			logp[n++] = -m->act.losses[i];
+		}
+		if (out != NULL && fwrite(logp, sizeof(float), n, out) !=
+				(size_t) n) {
+			fprintf(stderr, "Failed to write %s.\n", cfg.out);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	double dt = now_s() - t0;
+	long scored = tk.n - 1;
+	printf("%ld tokens, %.6f nats per token, perplexity %.4f,"
+			" %.1f tokens/s\n", scored, nll / scored,
+			exp(nll / scored), scored / dt);
+
+	if (out != NULL && fclose(out) != 0) {
+		fprintf(stderr, "Failed to write %s.\n", cfg.out);
+		exit(EXIT_FAILURE);
+	}
+
+	free(logp);
+	free(target);
+	free(in);
+	munmap(tk.map, tk.map_bytes);
+	iimc_pool_free(m->pool);
+	iimc_gpt2_free(m);
+	return 0;
+}
@@ -0,0 +1,604 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "iimc.h"
+
+/*
+ * iimcd keeps one model in memory and serves generation requests on a unix
+ * domain socket.
+ *
+ * A client connects and sends one line "N SEED PROMPT\n": generate up to N
+ * tokens (-1 for no limit) continuing PROMPT with the sampler seeded by
+ * SEED. The daemon streams the text of every token back as soon as it is
+ * sampled and closes the connection when the sequence stops at the end of
+ * text token, after N tokens or when the sequence length is reached.
+ *
+ * Every running request owns one kv cache slot. Each iteration first
+ * prefills waiting requests into the free slots, then decodes the newest
+ * token of all running requests in one batched forward pass, so requests
+ * join and leave the batch independently. Requests that find all slots
+ * busy wait for the next free one in arrival order. An iteration admits
+ * requests until SERVER_PREFILL_TOKENS prompt tokens ran, at least one,
+ * so a burst of arrivals does not stall the running requests for the sum
+ * of their prefills. With a prefix
+ * cache, a prompt that starts like an earlier one, e.g. with the same
+ * system prompt, only prefills the tokens after the common part.
+ */
+
+#define SERVER_MAX_CLIENTS	256
+#define SERVER_REQUEST_MAX	4096
+#define SERVER_PREFILL_TOKENS	512
+
+enum client_state {
+	CLIENT_FREE = 0,
+	CLIENT_READING,		/* waiting for the request line */
+	CLIENT_WAITING,		/* waiting for a free slot */
+	CLIENT_RUNNING
+};
+
+struct client {
+	int state;
+	int fd;
+	char req[SERVER_REQUEST_MAX];
+	int req_len;
+	unsigned long serial;	/* arrival order of complete requests */
+	int num_token;
+	unsigned long long rng_state;
+	int slot;
+	int count;
+	int next;
+};
+
+struct server {
+	const char *mf;
+	const char *tf;
+	const char *path;
+	int mmap;
+	int dtype;
+	int batch;
+	int seq_len;
+	int threads;
+	int numa;
+	float temperature;
+	int top_k;
+	float top_p;
+	size_t prefix_budget;
+
+	struct iimc_gpt2 *m;
+	struct iimc_prefix *prefix;
+	struct iimc_bpe *tokenizer;
+	struct iimc_sampler *sampler;
+	int lfd;
+	struct client client[SERVER_MAX_CLIENTS];
+	struct pollfd pfd[SERVER_MAX_CLIENTS + 1];
+	int *slot_owner;	/* client index per kv cache slot, -1 if free */
+	int *slots;
+	int *in;
+	int *rows;
+	int *prompt;
+	unsigned long serial;
+};
+
+static void print_help()
+{
+	 printf("Usage: iimcd [OPTION]...\n"
+		"Serve GPT2 generation requests on a unix domain socket.\n\n"
+		"  -b\t\tgenerate up to b sequences together\n"
+		"  -C\t\tkeep up to C MiB of prompt prefixes to skip their"
+		" prefill\n"
+		"  -d\t\tset tokenizer decoding file path\n"
+		"  -h\t\tdisplay this help and exit\n"
+		"  -j\t\trun on j threads (default all cpus)\n"
+		"  -k\t\tsample only from the k most likely tokens\n"
+		"  -l\t\tlimit the maximum sequence length\n"
+		"  -m\t\tset model file path\n"
+		"  -M\t\tmap the model file instead of reading it\n"
+		"  -N\t\tplace the weights on the NUMA nodes, interleave"
+		" or replicate\n"
+		"  -q\t\tquantize the matmul weights to int8 at load\n"
+		"  -S\t\tset socket path\n"
+		"  -t\t\tset sampling temperature\n"
+		"  -u\t\tsample only from the smallest set of tokens whose\n"
+		"    \t\tprobabilities add up to at least u (nucleus sampling)\n"
+		"\nA request is one line \"N SEED PROMPT\". The generated text"
+		" is streamed back\nand the connection is closed after N tokens"
+		" (-1 for no limit), the end\nof text token or the maximum"
+		" sequence length.\n");
+}
+
+static void server_default(struct server *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->mf = "gpt2_124M.bin";
+	s->tf = "gpt2_tokenizer.bin";
+	s->path = "iimc.sock";
+	s->dtype = IIMC_DTYPE_F32;
+	s->batch = 8;
+	s->seq_len = -1;
+	s->temperature = 1.0f;
+	s->top_k = 0;
+	s->top_p = 1.0f;
+	s->lfd = -1;
+}
+
+static void parse_cmd(int argc, char *argv[], struct server *s)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "b:C:d:hj:k:l:m:MN:qS:t:u:")) != -1) {
+		switch (opt) {
+			case 'b':
+				s->batch = atoi(optarg);
+				break;
+			case 'C':
+				s->prefix_budget = (size_t) atol(optarg) << 20;
+				break;
+			case 'd':
+				s->tf = optarg;
+				break;
+			case 'h':
+				print_help();
+				exit(EXIT_SUCCESS);
+			case 'j':
+				s->threads = atoi(optarg);
+				break;
+			case 'k':
+				s->top_k = atoi(optarg);
+				break;
+			case 'l':
+				s->seq_len = atoi(optarg);
+				break;
+			case 'm':
+				s->mf = optarg;
+				break;
+			case 'M':
+				s->mmap = 1;
+				break;
+			case 'N':
+				s->numa = iimc_numa_parse(optarg);
+				if (s->numa < 0) {
+					fprintf(stderr, "Unknown NUMA placement"
+							" %s.\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'q':
+				s->dtype = IIMC_DTYPE_Q8;
+				break;
+			case 'S':
+				s->path = optarg;
+				break;
+			case 't':
+				s->temperature = atof(optarg);
+				break;
+			case 'u':
+				s->top_p = atof(optarg);
+				break;
+			default:
+				print_help();
+				exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static int server_listen(struct server *s)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(s->path) >= sizeof(addr.sun_path))
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, s->path);
+
+	s->lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			0);
+	if (s->lfd < 0)
+		return -1;
+
+	unlink(s->path);
+	if (bind(s->lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		return -1;
+	if (listen(s->lfd, SOMAXCONN) < 0)
+		return -1;
+
+	return 0;
+}
+
+static void client_close(struct server *s, struct client *c)
+{
+	if (c->state == CLIENT_RUNNING)
+		s->slot_owner[c->slot] = -1;
+	close(c->fd);
+	c->state = CLIENT_FREE;
+}
+
+/* a client that cannot take the next token right away is dropped */
+static int client_send(struct client *c, const char *buf, size_t n)
+{
+	ssize_t r = send(c->fd, buf, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+	return r == (ssize_t) n ? 0 : -1;
+}
+
+static void server_accept(struct server *s)
+{
+	int fd;
+	while ((fd = accept4(s->lfd, NULL, NULL,
+					SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		int i;
+		for (i = 0; i < SERVER_MAX_CLIENTS; i++)
+			if (s->client[i].state == CLIENT_FREE)
+				break;
+		if (i == SERVER_MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+
+		struct client *c = &s->client[i];
+		c->state = CLIENT_READING;
+		c->fd = fd;
+		c->req_len = 0;
+	}
+}
+
+/* parses "N SEED PROMPT" once the whole line has arrived */
+static void client_read(struct server *s, struct client *c)
+{
+	ssize_t r = read(c->fd, c->req + c->req_len,
+			SERVER_REQUEST_MAX - 1 - c->req_len);
+	if (r < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (r <= 0) {
+		client_close(s, c);
+		return;
+	}
+	c->req_len += r;
+	c->req[c->req_len] = '\0';
+
+	char *eol = strchr(c->req, '\n');
+	if (eol == NULL) {
+		if (c->req_len == SERVER_REQUEST_MAX - 1) {
+			client_send(c, "error: request too long\n", 24);
+			client_close(s, c);
+		}
+		return;
+	}
+	*eol = '\0';
+
+	char *p = c->req;
+	char *end;
+	/* -1 is the only count that does not limit the sequence */
+	long num_token = strtol(p, &end, 10);
+	if (end == p || num_token == 0 || num_token < -1 ||
+			num_token > INT_MAX) {
+		client_send(c, "error: bad request\n", 19);
+		client_close(s, c);
+		return;
+	}
+	c->num_token = num_token;
+	p = end;
+	c->rng_state = strtoull(p, &end, 10);
+	if (end == p) {
+		client_send(c, "error: bad request\n", 19);
+		client_close(s, c);
+		return;
+	}
+	if (*end == ' ')
+		end++;
+	c->req_len = eol - end;
+	memmove(c->req, end, c->req_len + 1);
+
+	c->state = CLIENT_WAITING;
+	c->serial = s->serial++;
+}
+
+/* sends the sampled token, returns 1 while the sequence goes on */
+static int client_emit(struct server *s, struct client *c, int value)
+{
+	if (value == GPT2_EOT)
+		return 0;
+
+	const char *text = iimc_bpe_decode(s->tokenizer, value);
+	if (text != NULL && client_send(c, text, strlen(text)) < 0)
+		return 0;
+
+	c->count++;
+	c->next = value;
+	if (c->count == c->num_token ||
+			s->m->kv.len[c->slot] >= s->seq_len)
+		return 0;
+	return 1;
+}
+
+/*
+ * Prefills what the prefix cache does not hold of the prompt and counts
+ * the tokens that ran in *run.
+ */
+static int server_prefill(struct server *s, int slot, int *prompt, int n,
+		int *run)
+{
+	*run = n;
+	if (s->prefix == NULL)
+		return iimc_gpt2_prefill_slot(s->m, slot, prompt, n);
+
+	/* the last token always runs for its logits */
+	int hit = iimc_prefix_load(s->prefix, s->m, slot, prompt, n - 1);
+	*run = n - hit;
+	int r = iimc_gpt2_append_slot(s->m, slot, prompt + hit, n - hit);
+	if (r != IIMC_ENONE)
+		return r;
+
+	iimc_prefix_store(s->prefix, s->m, slot, prompt, n);
+	return IIMC_ENONE;
+}
+
+/*
+ * Prefills the oldest waiting request into a free slot and takes the
+ * tokens that ran off *budget. Returns 0 if no request is waiting.
+ */
+static int server_admit(struct server *s, int slot, int *budget)
+{
+	struct client *c = NULL;
+	int i;
+	for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+		struct client *o = &s->client[i];
+		if (o->state == CLIENT_WAITING &&
+				(c == NULL || o->serial < c->serial))
+			c = o;
+	}
+	if (c == NULL)
+		return 0;
+
+	/* like the token buffer of iimc, keep the newest tokens that fit */
+	int *prompt = s->prompt;
+	prompt[0] = GPT2_EOT;
+	int n = iimc_bpe_encode(s->tokenizer, c->req, c->req_len, prompt + 1);
+	if (n < 0) {
+		client_send(c, "error: bad prompt\n", 18);
+		client_close(s, c);
+		return 1;
+	}
+	n++;
+	if (n > s->seq_len) {
+		prompt += n - s->seq_len;
+		n = s->seq_len;
+	}
+
+	c->state = CLIENT_RUNNING;
+	c->slot = slot;
+	c->count = 0;
+	s->slot_owner[slot] = c - s->client;
+
+	int run;
+	int r = server_prefill(s, slot, prompt, n, &run);
+	*budget -= run;
+	if (r != IIMC_ENONE) {
+		client_close(s, c);
+		return 1;
+	}
+
+	int value = iimc_sampler_sample(s->sampler, s->m->act.logits,
+			&c->rng_state);
+	if (!client_emit(s, c, value))
+		client_close(s, c);
+	return 1;
+}
+
+/* one batched decode step over all running requests */
+static void server_step(struct server *s)
+{
+	int v = s->m->cfg.vocab_size;
+	int n = 0;
+	int i;
+
+	for (i = 0; i < s->batch; i++) {
+		if (s->slot_owner[i] < 0)
+			continue;
+		struct client *c = &s->client[s->slot_owner[i]];
+		s->slots[n] = i;
+		s->in[n] = c->next;
+		s->rows[n++] = s->slot_owner[i];
+	}
+	if (n == 0)
+		return;
+
+	if (iimc_gpt2_decode_slots(s->m, s->slots, s->in, n) != IIMC_ENONE) {
+		for (i = 0; i < n; i++)
+			client_close(s, &s->client[s->rows[i]]);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct client *c = &s->client[s->rows[i]];
+		int value = iimc_sampler_sample(s->sampler,
+				s->m->act.logits + (size_t) i * v,
+				&c->rng_state);
+		if (!client_emit(s, c, value))
+			client_close(s, c);
+	}
+}
+
+/*
+ * Fills the free slots in arrival order. A request that fails or ends
+ * with its first token frees the slot again for the next one.
+ */
+static void server_admit_all(struct server *s)
+{
+	int budget = SERVER_PREFILL_TOKENS;
+	int i;
+	for (i = 0; i < s->batch && budget > 0; i++)
+		while (s->slot_owner[i] < 0 && budget > 0)
+			if (!server_admit(s, i, &budget))
+				return;
+}
+
+/* whether there is a request to decode or to admit */
+static int server_busy(struct server *s)
+{
+	int i;
+	for (i = 0; i < s->batch; i++)
+		if (s->slot_owner[i] >= 0)
+			return 1;
+	for (i = 0; i < SERVER_MAX_CLIENTS; i++)
+		if (s->client[i].state == CLIENT_WAITING)
+			return 1;
+	return 0;
+}
+
+static void server_loop(struct server *s)
+{
+	for (;;) {
+		int n = 0;
+		int i, j;
+
+		s->pfd[n].fd = s->lfd;
+		s->pfd[n++].events = POLLIN;
+		for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+			if (s->client[i].state != CLIENT_READING)
+				continue;
+			s->pfd[n].fd = s->client[i].fd;
+			s->pfd[n++].events = POLLIN;
+		}
+
+		/* only block when there is nothing to decode or admit */
+		if (poll(s->pfd, n, server_busy(s) ? 0 : -1) < 0 &&
+				errno != EINTR) {
+			perror("poll");
+			return;
+		}
+
+		if (s->pfd[0].revents & POLLIN)
+			server_accept(s);
+		/* clients just accepted were not polled and are skipped */
+		for (i = 0, j = 1; i < SERVER_MAX_CLIENTS && j < n; i++) {
+			struct client *c = &s->client[i];
+			if (c->state != CLIENT_READING || c->fd != s->pfd[j].fd)
+				continue;
+			if (s->pfd[j++].revents & (POLLIN | POLLHUP | POLLERR))
+				client_read(s, c);
+		}
+
+		server_admit_all(s);
+		server_step(s);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct server s;
+	int r;
+	int i;
+
+	server_default(&s);
+	parse_cmd(argc, argv, &s);
+
+	if (s.batch < 1) {
+		fprintf(stderr, "The batch size must be at least 1.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	s.m = iimc_gpt2_new();
+	if (s.m == NULL) {
+		fprintf(stderr, "Failed to allocate memory for model. "
+				"Likely out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (s.mmap)
+		r = iimc_gpt2_load_mmap(s.m, s.mf, IIMC_MMAP_WILLNEED);
+	else
+		r = iimc_gpt2_load(s.m, s.mf);
+	if (r != IIMC_ENONE) {
+		fprintf(stderr, "Failed to load model %s.\n", s.mf);
+		exit(EXIT_FAILURE);
+	}
+
+	if (s.dtype != IIMC_DTYPE_F32 &&
+			iimc_gpt2_quantize(s.m, s.dtype) != IIMC_ENONE) {
+		fprintf(stderr, "Failed to quantize model.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (iimc_gpt2_numa(s.m, s.numa) != IIMC_ENONE) {
+		fprintf(stderr, "Failed to place model on the NUMA nodes.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (s.seq_len < 1 || s.seq_len > s.m->cfg.max_seq_len)
+		s.seq_len = s.m->cfg.max_seq_len;
+
+	if (s.threads < 1)
+		s.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	s.m->pool = iimc_pool_new(s.threads > 0 ? s.threads : 1, NULL);
+	if (s.m->pool == NULL) {
+		fprintf(stderr, "Failed to start %d threads.\n", s.threads);
+		exit(EXIT_FAILURE);
+	}
+
+	s.m->output = IIMC_OUTPUT_LAST | IIMC_OUTPUT_LOGITS;
+	if (iimc_gpt2_init(s.m, s.batch, s.seq_len) != IIMC_ENONE) {
+		fprintf(stderr, "Failed to init model.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	s.tokenizer = iimc_bpe_new();
+	if (s.tokenizer == NULL ||
+			iimc_bpe_load(s.tokenizer, s.tf) != IIMC_ENONE) {
+		fprintf(stderr, "Failed to load tokenizer %s.\n", s.tf);
+		exit(EXIT_FAILURE);
+	}
+
+	if (s.prefix_budget > 0) {
+		s.prefix = iimc_prefix_new(s.m, s.prefix_budget);
+		if (s.prefix == NULL) {
+			fprintf(stderr, "Failed to init prefix cache.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	s.sampler = iimc_sampler_new(s.m->cfg.vocab_size, s.temperature,
+			s.top_k, s.top_p);
+	s.slot_owner = malloc(s.batch * sizeof(int));
+	s.slots = malloc(s.batch * sizeof(int));
+	s.in = malloc(s.batch * sizeof(int));
+	s.rows = malloc(s.batch * sizeof(int));
+	s.prompt = malloc((SERVER_REQUEST_MAX + 1) * sizeof(int));
+	if (s.sampler == NULL || s.slot_owner == NULL || s.slots == NULL ||
+			s.in == NULL || s.rows == NULL || s.prompt == NULL) {
+		fprintf(stderr, "Failed to allocate server state.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < s.batch; i++)
+		s.slot_owner[i] = -1;
+
+	if (server_listen(&s) < 0) {
+		fprintf(stderr, "Failed to listen on %s.\n", s.path);
+		exit(EXIT_FAILURE);
+	}
+
+	server_loop(&s);
+
+	close(s.lfd);
+	unlink(s.path);
+	free(s.prompt);
+	free(s.rows);
+	free(s.in);
+	free(s.slots);
+	free(s.slot_owner);
+	iimc_sampler_free(s.sampler);
+	iimc_prefix_free(s.prefix);
+	iimc_bpe_free(s.tokenizer);
+	iimc_pool_free(s.m->pool);
+	iimc_gpt2_free(s.m);
+	return 0;
+}